@@ -0,0 +1,34 @@
+#include "accel.h"
+#include "bvh.h"
+#include "widebvh.h"
+#include "qbvh.h"
+#include "grid.h"
+#include "bruteforce.h"
+#include "kdtree.h"
+
+Accelerator* createAccelerator(const std::string& type, float spatialSplitBudget) {
+    if (type == "bvh") {
+        return new BVH();
+    } else if (type == "sbvh") {
+        return new BVH(BVH::Method::Spatial, spatialSplitBudget);
+    } else if (type == "lbvh") {
+        return new BVH(BVH::Method::Linear);
+    } else if (type == "hlbvh") {
+        return new BVH(BVH::Method::Hybrid);
+    } else if (type == "bvh4") {
+        return new WideBVH<4>();
+    } else if (type == "bvh8") {
+        return new WideBVH<8>();
+    } else if (type == "qbvh") {
+        return new QuantizedBVH();
+    } else if (type == "grid") {
+        return new Grid(1);
+    } else if (type == "hgrid") {
+        return new Grid(2);
+    } else if (type == "kdtree") {
+        return new KdTree();
+    } else if (type == "brute") {
+        return new BruteForce();
+    }
+    return nullptr;
+}
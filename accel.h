@@ -0,0 +1,67 @@
+#ifndef ACCEL_H
+#define ACCEL_H
+#include <string>
+#include <vector>
+#include "base.h"
+
+class CacheWriter;
+class CacheReader;
+
+// Ray query interface shared by the acceleration structures the renderer can select
+class Accelerator {
+public:
+    // Largest ray packet intersectPacket handles in one traversal (an 8x8 pixel block)
+    static constexpr int kMaxPacketSize = 64;
+
+    virtual ~Accelerator() {}
+
+    virtual void build(const std::vector<Shape*>& shapes) = 0;
+    // Updates the structure after shapes moved without changing the shape list.
+    // Returns the expected query cost relative to the last build (1 = as good as new).
+    virtual float refit() = 0;
+
+    // Finds the closest shape along the ray; hit.distance acts as the upper bound on entry
+    virtual bool intersect(const Ray& ray, Hit& hit) const = 0;
+    // Closest hits for a bundle of coherent rays, such as the primary rays of a pixel
+    // block; hits[i] belongs to rays[i]. Structures without packet traversal trace the
+    // rays one by one.
+    virtual void intersectPacket(const Ray* rays, int count, Hit* hits) const {
+        for (int i = 0; i < count; ++i) {
+            intersect(rays[i], hits[i]);
+        }
+    }
+    // Any-hit query for shadow rays: true as soon as some shape blocks the ray before
+    // tMax. Stops at the first blocker, which is returned, and never computes the
+    // closest hit.
+    virtual bool occluded(const Ray& ray, float tMax, Shape*& blocker) const = 0;
+    // Any-hit queries for a stream of rays: blockers[i] is set to the shape blocking
+    // rays[i] before tMax[i], or null. Callers sort the stream for coherence; the default
+    // answers the rays one by one.
+    virtual void occludedBatch(const Ray* rays, const float* tMax, int count, Shape** blockers) const {
+        for (int i = 0; i < count; ++i) {
+            blockers[i] = nullptr;
+            occluded(rays[i], tMax[i], blockers[i]);
+        }
+    }
+
+    // Bytes held by the structure: nodes plus primitive references
+    virtual size_t memoryUsage() const = 0;
+    virtual const char* name() const = 0;
+
+    // Serialization for the on-disk cache (see scenecache.h). Primitives are stored as
+    // indices into shapes, the list the structure was built over. Types that build fast
+    // enough not to need a cache keep the defaults, which decline.
+    virtual bool saveCache(CacheWriter& /*out*/, const std::vector<Shape*>& /*shapes*/) const { return false; }
+    virtual bool loadCache(CacheReader& /*in*/, const std::vector<Shape*>& /*shapes*/) { return false; }
+};
+
+// Creates the accelerator selected by the scene's "accelerator" key, or null if unknown.
+// Available types: "bvh" (binary, default), "sbvh" (binary with spatial splits), "lbvh"
+// and "hlbvh" (binary, built fast from Morton codes for per-frame rebuilds), "bvh4"
+// and "bvh8" (SIMD-wide BVH), "qbvh" (compressed 4-wide BVH), "grid" (uniform grid) and
+// "hgrid" (two-level grid), "kdtree" (SAH kd-tree with ropes) and "brute" (no structure,
+// every shape tested). spatialSplitBudget is the extra primitive references an sbvh
+// may create, as a fraction of the primitive count.
+Accelerator* createAccelerator(const std::string& type, float spatialSplitBudget = 0.3f);
+
+#endif // ACCEL_H
@@ -21,6 +21,85 @@ Vector3 Matrix4x4:: operator*(const Vector3& v) const {
         return { resultX, resultY, resultZ };
     }
 
+Matrix4x4 Matrix4x4::operator*(const Matrix4x4& rhs) const {
+    Matrix4x4 result;
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            result.m[i][j] = 0.0f;
+            for (int k = 0; k < 4; ++k) {
+                result.m[i][j] += m[i][k] * rhs.m[k][j];
+            }
+        }
+    }
+    return result;
+}
+
+Matrix4x4 Matrix4x4::transpose() const {
+    Matrix4x4 result;
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            result.m[i][j] = m[j][i];
+        }
+    }
+    return result;
+}
+
+Matrix4x4 Matrix4x4::inverse() const {
+    // Gauss-Jordan elimination with partial pivoting on [A | I]
+    float a[4][8];
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            a[i][j] = m[i][j];
+            a[i][j + 4] = (i == j) ? 1.0f : 0.0f;
+        }
+    }
+    for (int col = 0; col < 4; ++col) {
+        int pivot = col;
+        for (int row = col + 1; row < 4; ++row) {
+            if (std::abs(a[row][col]) > std::abs(a[pivot][col])) {
+                pivot = row;
+            }
+        }
+        if (std::abs(a[pivot][col]) < 1e-12f) {
+            return identity();
+        }
+        if (pivot != col) {
+            for (int j = 0; j < 8; ++j) {
+                std::swap(a[pivot][j], a[col][j]);
+            }
+        }
+        float invPivot = 1.0f / a[col][col];
+        for (int j = 0; j < 8; ++j) {
+            a[col][j] *= invPivot;
+        }
+        for (int row = 0; row < 4; ++row) {
+            if (row != col && a[row][col] != 0.0f) {
+                float factor = a[row][col];
+                for (int j = 0; j < 8; ++j) {
+                    a[row][j] -= factor * a[col][j];
+                }
+            }
+        }
+    }
+    Matrix4x4 result;
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            result.m[i][j] = a[i][j + 4];
+        }
+    }
+    return result;
+}
+
+Matrix4x4 Matrix4x4::identity() {
+    Matrix4x4 result;
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            result.m[i][j] = (i == j) ? 1.0f : 0.0f;
+        }
+    }
+    return result;
+}
+
 // Vector3 operator+(const Vector3& lhs, const Vector3& rhs) {
 //     return { lhs.x + rhs.x, lhs.y + rhs.y, lhs.z + rhs.z };
 // }
@@ -1,10 +1,115 @@
 #ifndef BASE_H
 #define BASE_H
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <vector>
 #include <string>
+#include <limits>
+#include <algorithm>
+#include "simd.h"
+
+#if defined(RT_SIMD_MATH)
+// Sum of the low three lanes, added in the order x + y + z of the scalar code
+inline float sumXYZ(__m128 p) {
+    __m128 sum = _mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_add_ss(sum, _mm_movehl_ps(p, p)));
+}
+
+// v divided by the square root of the low lane of lengthSquared: a true square root and
+// division, matching the scalar build bit for bit, or with RT_FAST_RSQRT v scaled by the
+// hardware reciprocal square root estimate refined by one Newton step (about 22 correct
+// bits), which moves shadow and silhouette edges by a pixel here and there.
+inline __m128 divideBySqrt(__m128 v, __m128 lengthSquared) {
+#if defined(RT_FAST_RSQRT)
+    __m128 estimate = _mm_rsqrt_ss(lengthSquared);
+    __m128 refined = _mm_mul_ss(_mm_mul_ss(_mm_set_ss(0.5f), estimate),
+                                _mm_sub_ss(_mm_set_ss(3.0f), _mm_mul_ss(_mm_mul_ss(lengthSquared, estimate), estimate)));
+    return _mm_mul_ps(v, _mm_shuffle_ps(refined, refined, 0));
+#else
+    __m128 root = _mm_sqrt_ss(lengthSquared);
+    return _mm_div_ps(v, _mm_shuffle_ps(root, root, 0));
+#endif
+}
+
+// The SIMD build of Vector3 (RT_SIMD_VECTORS): the components live in the low lanes of an
+// SSE register, the fourth lane is unused, and every operation is one or two instructions.
+// The interface is the scalar class's below.
+class Vector3 {
+public:
+    union {
+        __m128 v;
+        struct {
+            float x, y, z, w;
+        };
+    };
+
+    Vector3(float x, float y, float z) : v(_mm_set_ps(0.0f, z, y, x)) {}
+    explicit Vector3(__m128 v) : v(v) {}
+    Vector3(){}
+    Vector3 operator+(const Vector3& rhs) const {
+        return Vector3(_mm_add_ps(v, rhs.v));
+    }
+
+    Vector3 operator-(const Vector3& rhs) const {
+        return Vector3(_mm_sub_ps(v, rhs.v));
+    }
+
+    Vector3 operator*(float scalar) const {
+        return Vector3(_mm_mul_ps(v, _mm_set1_ps(scalar)));
+    }
+
+    Vector3 operator-() const {
+        return Vector3(_mm_xor_ps(v, _mm_set1_ps(-0.0f)));
+    }
+    Vector3 normalize() {
+        __m128 lengthSquared = _mm_set_ss(sumXYZ(_mm_mul_ps(v, v)));
+        // Check for divide by zero
+        if (_mm_cvtss_f32(lengthSquared) > 0) {
+            return Vector3(divideBySqrt(v, lengthSquared));
+        }
+        return Vector3(_mm_setzero_ps());
+    }
+    float dot(const Vector3 other) {
+        return sumXYZ(_mm_mul_ps(v, other.v));
+    }
+    static float dot(const Vector3& a, const Vector3& b) {
+        return sumXYZ(_mm_mul_ps(a.v, b.v));
+    }
+
+    static Vector3 cross(const Vector3& a, const Vector3& b) {
+        __m128 aYZX = _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 0, 2, 1));
+        __m128 bYZX = _mm_shuffle_ps(b.v, b.v, _MM_SHUFFLE(3, 0, 2, 1));
+        __m128 aZXY = _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 1, 0, 2));
+        __m128 bZXY = _mm_shuffle_ps(b.v, b.v, _MM_SHUFFLE(3, 1, 0, 2));
+        return Vector3(_mm_sub_ps(_mm_mul_ps(aYZX, bZXY), _mm_mul_ps(aZXY, bYZX)));
+    }
 
+    static Vector3 normalize(const Vector3& v) {
+        return Vector3(divideBySqrt(v.v, _mm_set_ss(lengthSquared(v))));
+    }
+    static float lengthSquared(const Vector3& v) {
+        return sumXYZ(_mm_mul_ps(v.v, v.v));
+    }
+    static float projectAlongAxis(const Vector3& point, const Vector3& axis) {
+        return Vector3::dot(point, Vector3::normalize(axis));
+    }
+    static float length(const Vector3& v) {
+        return _mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ss(lengthSquared(v))));
+    }
+    // Component access by axis index (0 = x, 1 = y, 2 = z)
+    float operator[](int axis) const {
+        return axis == 0 ? x : (axis == 1 ? y : z);
+    }
+    // Operands swapped so ties and NaNs resolve as std::min and std::max do
+    static Vector3 min(const Vector3& a, const Vector3& b) {
+        return Vector3(_mm_min_ps(b.v, a.v));
+    }
+    static Vector3 max(const Vector3& a, const Vector3& b) {
+        return Vector3(_mm_max_ps(b.v, a.v));
+    }
+};
+#else
 class Vector3 {
 public:
     float x, y, z;
@@ -29,7 +134,7 @@ public:
         return {-x, -y, -z};
     }
     Vector3 normalize() {
-        float magnitude = sqrt(x * x + y * y + z * z);
+        float magnitude = std::sqrt(x * x + y * y + z * z);
         Vector3 ret;
         // Check for divide by zero
         if (magnitude > 0) {
@@ -56,7 +161,7 @@ public:
     }
 
     static Vector3 normalize(const Vector3& v) {
-        float magnitude = sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+        float magnitude = std::sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
         return {v.x / magnitude, v.y / magnitude, v.z / magnitude};
     }
     static float lengthSquared(const Vector3& v) {
@@ -66,15 +171,184 @@ public:
         return Vector3::dot(point, Vector3::normalize(axis));
     }
     static float length(const Vector3& v) {
-        return sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+        return std::sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+    }
+    // Component access by axis index (0 = x, 1 = y, 2 = z)
+    float operator[](int axis) const {
+        return axis == 0 ? x : (axis == 1 ? y : z);
+    }
+    static Vector3 min(const Vector3& a, const Vector3& b) {
+        return {std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z)};
+    }
+    static Vector3 max(const Vector3& a, const Vector3& b) {
+        return {std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z)};
+    }
+};
+#endif
+
+class Ray {
+public:
+    Vector3 origin;
+    Vector3 direction;
+
+    Ray(const Vector3& origin, const Vector3& direction)
+        : origin(origin), direction(direction) {}
+    
+    // Function to compute a point along the ray
+    Vector3 at(float t) const {
+        return origin + direction * t;
     }
 };
+
+// Axis-aligned bounding box used by the acceleration structures
+class AABB {
+public:
+    Vector3 min, max;
+
+    // Default constructor creates an empty box, so the first expand() sets it
+    AABB()
+        : min(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()),
+          max(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max()) {}
+    AABB(const Vector3& min, const Vector3& max) : min(min), max(max) {}
+
+    void expand(const Vector3& p) {
+        min = Vector3::min(min, p);
+        max = Vector3::max(max, p);
+    }
+    void expand(const AABB& box) {
+        min = Vector3::min(min, box.min);
+        max = Vector3::max(max, box.max);
+    }
+    bool isEmpty() const {
+        return min.x > max.x || min.y > max.y || min.z > max.z;
+    }
+    Vector3 centroid() const {
+        return (min + max) * 0.5f;
+    }
+    Vector3 extent() const {
+        return max - min;
+    }
+    float surfaceArea() const {
+        if (isEmpty()) {
+            return 0.0f;
+        }
+        Vector3 e = extent();
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+    int longestAxis() const {
+        Vector3 e = extent();
+        if (e.x > e.y && e.x > e.z) return 0;
+        return e.y > e.z ? 1 : 2;
+    }
+    // Slab test; invDir is 1 / ray.direction, precomputed once per ray.
+    // On a hit within [0, tMax] the entry distance is written to tNear.
+    bool intersect(const Ray& ray, const Vector3& invDir, float tMax, float& tNear) const {
+        float t0 = (min.x - ray.origin.x) * invDir.x;
+        float t1 = (max.x - ray.origin.x) * invDir.x;
+        float tEnter = std::min(t0, t1);
+        float tExit = std::max(t0, t1);
+        t0 = (min.y - ray.origin.y) * invDir.y;
+        t1 = (max.y - ray.origin.y) * invDir.y;
+        tEnter = std::max(tEnter, std::min(t0, t1));
+        tExit = std::min(tExit, std::max(t0, t1));
+        t0 = (min.z - ray.origin.z) * invDir.z;
+        t1 = (max.z - ray.origin.z) * invDir.z;
+        tEnter = std::max(tEnter, std::min(t0, t1));
+        tExit = std::min(tExit, std::max(t0, t1));
+        tNear = tEnter;
+        return tEnter <= tExit && tExit >= 0.0f && tEnter <= tMax;
+    }
+};
+
+// 30-bit Morton code of a point given in [0, 1]^3: the bits of its 10-bit grid
+// coordinates interleaved, so that sorting by code keeps nearby points together
+inline uint32_t mortonCode(const Vector3& unit) {
+    auto spread = [](float value) {
+        uint32_t v = static_cast<uint32_t>(std::min(std::max(value * 1024.0f, 0.0f), 1023.0f));
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    };
+    return (spread(unit.x) << 2) | (spread(unit.y) << 1) | spread(unit.z);
+}
 class Matrix4x4 {
 public:
     float m[4][4];
 
+    // Transforms a point (w = 1), dividing by the resulting w
     Vector3 operator*(const Vector3& v) const;
+    Matrix4x4 operator*(const Matrix4x4& rhs) const;
+    // Transforms a direction (w = 0): only the upper 3x3 part applies
+    Vector3 transformDirection(const Vector3& v) const {
+        return {
+            m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+            m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+            m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z
+        };
+    }
+    Matrix4x4 transpose() const;
+    // General inverse; returns the identity if the matrix is singular
+    Matrix4x4 inverse() const;
+    static Matrix4x4 identity();
 };
+#if defined(RT_SIMD_MATH)
+// The SIMD build of Color, laid out like the SIMD Vector3
+class Color {
+public:
+    union {
+        __m128 v;
+        struct {
+            float r, g, b, a;
+        };
+    };
+
+    Color() : v(_mm_setzero_ps()) {}
+    Color(float red, float green, float blue) : v(_mm_set_ps(0.0f, blue, green, red)) {}
+    explicit Color(__m128 v) : v(v) {}
+
+    void getAsIntegers(unsigned char &red, unsigned char &green, unsigned char &blue) const {
+        red = static_cast<unsigned char>(r * 255);
+        green = static_cast<unsigned char>(g * 255);
+        blue = static_cast<unsigned char>(b * 255);
+    }
+
+    Color operator+(const Color& other) const {
+        return Color(_mm_add_ps(v, other.v));
+    }
+    Color operator-(const Color& other) const {
+        return Color(_mm_sub_ps(v, other.v));
+    }
+    Color operator*(float scalar) const {
+        return Color(_mm_mul_ps(v, _mm_set1_ps(scalar)));
+    }
+    Color operator*(const Color& other) const {
+        return Color(_mm_mul_ps(v, other.v));
+    }
+
+    Color& operator+=(const Color& other) {
+        v = _mm_add_ps(v, other.v);
+        return *this;
+    }
+    Color& operator-=(const Color& other) {
+        v = _mm_sub_ps(v, other.v);
+        return *this;
+    }
+    Color& operator*=(float scalar) {
+        v = _mm_mul_ps(v, _mm_set1_ps(scalar));
+        return *this;
+    }
+    Color& operator*=(const Color& other) {
+        v = _mm_mul_ps(v, other.v);
+        return *this;
+    }
+    // Clamps color values to the range [0, 1], NaN going to 1 as in the scalar build
+    void clamp() {
+        v = _mm_max_ps(_mm_min_ps(v, _mm_set1_ps(1.0f)), _mm_setzero_ps());
+    }
+};
+#else
 class Color {
 public:
     float r, g, b;
@@ -156,6 +430,7 @@ public:
         b = std::max(0.0f, std::min(1.0f, b));
     }
 };
+#endif
 
 
 class Material {
@@ -174,25 +449,71 @@ public:
     Material() : ks(0), kd(0), specularExponent(0), isReflective(false), reflectivity(0), isRefractive(false), refractiveIndex(1.0f) {}
 };
 
+// Concrete shape classes, tagged on every Shape so intersection code can switch on them
+enum class ShapeType : uint8_t {
+    Sphere,
+    Cylinder,
+    Triangle,
+    Instance
+};
+
 class Shape {
 public:
     Material material;
-    virtual std::string getType() const = 0;
+    ShapeType type;
+
+    explicit Shape(ShapeType type) : type(type) {}
+    virtual ~Shape() {}
+    // Derives the data the ray tests and normals read from the parameters. The loader
+    // calls it once per shape; call it again after changing a shape by hand.
+    virtual void prepare() {}
+    // Name of the type as used in scene files
+    std::string getType() const {
+        switch (type) {
+        case ShapeType::Sphere:
+            return "sphere";
+        case ShapeType::Cylinder:
+            return "cylinder";
+        case ShapeType::Triangle:
+            return "triangle";
+        default:
+            return "instance";
+        }
+    }
     virtual Vector3 getNormal(const Vector3& point) const = 0;
+    virtual AABB getBounds() const = 0;
 };
 
 class Sphere : public Shape {
 public:
     Vector3 center;
     float radius;
-    
-    std::string getType() const override {
-        return "sphere";
+    // Derived by prepare()
+    float radiusSquared = 0.0f;
+
+    Sphere() : Shape(ShapeType::Sphere) {}
+    void prepare() override {
+        radiusSquared = radius * radius;
     }
     Vector3 getNormal(const Vector3& p) const {
         Vector3 outwardNormal = p - center; // Vector from the center of the sphere to the point p
         return Vector3::normalize(outwardNormal); // Normalize this vector to get the normal
     }
+    AABB getBounds() const override {
+        Vector3 r(radius, radius, radius);
+        return AABB(center - r, center + r);
+    }
+};
+
+// Cylinder data derived from its parameters, so ray tests need no normalization: an
+// orthonormal frame whose tangent, bitangent and unitAxis are the x, y and z axes of a
+// local space centered on the cylinder. There the side is x^2 + y^2 = radiusSquared and
+// the caps are the planes z = -halfHeight and z = halfHeight.
+struct CylinderFrame {
+    Vector3 tangent, bitangent, unitAxis;
+    Vector3 topCenter, bottomCenter;
+    float radiusSquared;
+    float halfHeight;
 };
 
 class Cylinder : public Shape {
@@ -200,24 +521,35 @@ public:
     Vector3 center;
     Vector3 axis;
     float radius, height;
-    
-    std::string getType() const override {
-        return "cylinder";
+    // Derived by prepare()
+    CylinderFrame frame;
+
+    Cylinder() : Shape(ShapeType::Cylinder) {}
+    void prepare() override {
+        const Vector3 w = Vector3::normalize(axis);
+        // Branchless orthonormal basis around w (Duff et al., 2017)
+        float sign = std::copysign(1.0f, w.z);
+        float a = -1.0f / (sign + w.z);
+        float b = w.x * w.y * a;
+        frame.tangent = Vector3(1.0f + sign * w.x * w.x * a, sign * b, -sign * w.x);
+        frame.bitangent = Vector3(b, sign + w.y * w.y * a, -w.y);
+        frame.unitAxis = w;
+        frame.halfHeight = height * 0.5f;
+        frame.topCenter = center + w * frame.halfHeight;
+        frame.bottomCenter = center - w * frame.halfHeight;
+        frame.radiusSquared = radius * radius;
     }
-    Vector3 getTopCenter() const {
-        Vector3 normalizedAxis = Vector3::normalize(axis);
-        return center + normalizedAxis * (height * 0.5f);
+    const Vector3& getTopCenter() const {
+        return frame.topCenter;
     }
 
-    Vector3 getBottomCenter() const {
-        Vector3 normalizedAxis = Vector3::normalize(axis);
-        return center - normalizedAxis * (height * 0.5f);
+    const Vector3& getBottomCenter() const {
+        return frame.bottomCenter;
     }
     Vector3 getNormal(const Vector3& p) const {
-        Vector3 normalizedAxis = Vector3::normalize(axis);
-        float halfHeight = height * 0.5f;
+        const Vector3& normalizedAxis = frame.unitAxis;
         float projection = Vector3::dot((p - center), normalizedAxis);
-        if (std::abs(projection) > halfHeight) {
+        if (std::abs(projection) > frame.halfHeight) {
             // The point is on the top or bottom cap
             return (projection < 0 ? -normalizedAxis : normalizedAxis);
         } else {
@@ -226,23 +558,56 @@ public:
             return Vector3::normalize(p - onAxis);
         }
     }
-
+    AABB getBounds() const override {
+        Vector3 normalizedAxis = Vector3::normalize(axis);
+        float halfHeight = height * 0.5f;
+        Vector3 e;
+        e.x = std::abs(normalizedAxis.x) * halfHeight + radius * sqrt(std::max(0.0f, 1.0f - normalizedAxis.x * normalizedAxis.x));
+        e.y = std::abs(normalizedAxis.y) * halfHeight + radius * sqrt(std::max(0.0f, 1.0f - normalizedAxis.y * normalizedAxis.y));
+        e.z = std::abs(normalizedAxis.z) * halfHeight + radius * sqrt(std::max(0.0f, 1.0f - normalizedAxis.z * normalizedAxis.z));
+        return AABB(center - e, center + e);
+    }
 };
 
 class Triangle : public Shape {
 public:
     Vector3 v0, v1, v2;
-    
-    std::string getType() const override {
-        return "triangle";
+    // Derived by prepare()
+    Vector3 edge1, edge2;
+    Vector3 normal;
+
+    Triangle() : Shape(ShapeType::Triangle) {}
+    void prepare() override {
+        edge1 = v1 - v0;
+        edge2 = v2 - v0;
+        normal = Vector3::normalize(Vector3::cross(edge1, edge2)); // The normal is the cross product of two edges of the triangle
     }
     Vector3 getNormal(const Vector3& point) const override {
-        Vector3 edge1 = v1 - v0;
-        Vector3 edge2 = v2 - v0;
-        return Vector3::normalize(Vector3::cross(edge1, edge2)); // The normal is the cross product of two edges of the triangle
+        return normal;
+    }
+    AABB getBounds() const override {
+        AABB box(v0, v0);
+        box.expand(v1);
+        box.expand(v2);
+        return box;
     }
 };
 
+class Instance;
+
+// Closest-hit record filled in by the acceleration structures
+struct Hit {
+    float distance;
+    Shape* shape;              // Shape whose surface was hit; a mesh triangle for instances
+    const Instance* instance;  // Instance the shape belongs to, or null for top-level shapes
+
+    Hit() : distance(std::numeric_limits<float>::max()), shape(nullptr), instance(nullptr) {}
+
+    // World-space surface normal and material at the hit, resolving instancing
+    Vector3 normal(const Vector3& point) const;
+    const Material& material() const;
+};
+
 
 class LightSource {
 public:
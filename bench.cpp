@@ -0,0 +1,261 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "head.h"
+#include "intersect.h"
+#include "shapepool.h"
+
+// Compares the accelerators on one scene: build time, memory, and ray throughput for
+// closest-hit primary rays (one by one and as 8x8 packets) and any-hit shadow rays
+// towards the first light, followed by a full render. Usage: bench <scene.json> [accelerator ...]
+// Built like the renderer, from every .cpp except main.cpp and render_video.cpp.
+//
+// bench --math <scene.json> instead times the Vector3 and Color arithmetic: intersection
+// kernels on the primary rays against the first shapes of the scene, and
+// calculateLocalIllumination at every primary hit. Build it with and without
+// -DRT_SIMD_VECTORS to compare the scalar and SSE math layers.
+//
+// bench --kernels <scene.json> times the sphere and triangle kernels alone: every primary
+// ray against every sphere and triangle of the scene, once one shape at a time and once a
+// block at a time with the block kernels cpu.h selects (RT_ISA picks a lower level).
+namespace {
+int benchMath(const char* scenePath) {
+    Renderer renderer;
+    renderer.useAcceleratorCache = false;
+    renderer.loadFromJSON(scenePath);
+    if (!renderer.accelerator) {
+        return 1;
+    }
+    renderer.rayGenerator.setup(renderer.camera);
+    std::vector<Ray> rays;
+    std::vector<std::pair<Ray, Hit>> hits;
+    for (int y = 0; y < renderer.camera.height; ++y) {
+        for (int x = 0; x < renderer.camera.width; ++x) {
+            rays.push_back(renderer.rayGenerator.ray(x, y));
+            Hit hit;
+            if (renderer.accelerator->intersect(rays.back(), hit)) {
+                hits.push_back({rays.back(), hit});
+            }
+        }
+    }
+
+    const size_t shapeCount = std::min<size_t>(renderer.scene.shapes.size(), 32);
+    size_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const Ray& ray : rays) {
+        for (size_t i = 0; i < shapeCount; ++i) {
+            float distance;
+            found += intersectShape(ray, renderer.scene.shapes[i], distance);
+        }
+    }
+    double intersectSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Shade each hit seen from the camera, as renderPhong does before its shadow test
+    Color sum;
+    start = std::chrono::steady_clock::now();
+    for (const auto& [ray, hit] : hits) {
+        Vector3 point = ray.origin + ray.direction * hit.distance;
+        sum += calculateLocalIllumination(point, hit.normal(point), hit.material(), ray.direction, renderer.scene.lights);
+    }
+    double shadeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+#if defined(RT_SIMD_MATH) && defined(RT_FAST_RSQRT)
+    const char* layer = "sse-fast";
+#elif defined(RT_SIMD_MATH)
+    const char* layer = "sse";
+#else
+    const char* layer = "scalar";
+#endif
+    std::printf("%-8s %16s %16s\n", "math", "intersect Mt/s", "shade Mlight/s");
+    std::printf("%-8s %16.2f %16.2f\n", layer, rays.size() * shapeCount / intersectSeconds * 1e-6,
+                hits.size() * renderer.scene.lights.size() / shadeSeconds * 1e-6);
+    // Keeps the timed loops from being optimized away
+    std::fprintf(stderr, "(%zu hits, color sum %g)\n", found, sum.r + sum.g + sum.b);
+    return 0;
+}
+
+int benchKernels(const char* scenePath) {
+    Renderer renderer;
+    renderer.acceleratorType = "brute";
+    renderer.useAcceleratorCache = false;
+    renderer.loadFromJSON(scenePath);
+    renderer.rayGenerator.setup(renderer.camera);
+    ShapePool pool;
+    pool.build(renderer.scene.shapes);
+    const ShapePool::Spheres& spheres = pool.spheres;
+    const ShapePool::Triangles& triangles = pool.triangles;
+    std::vector<Ray> rays;
+    for (int y = 0; y < renderer.camera.height; ++y) {
+        for (int x = 0; x < renderer.camera.width; ++x) {
+            rays.push_back(renderer.rayGenerator.ray(x, y));
+        }
+    }
+
+    // Both loops sum the distances of all hits, which must agree
+    auto timeLoop = [&](auto&& body, double& sum) {
+        sum = 0.0;
+        auto start = std::chrono::steady_clock::now();
+        for (const Ray& ray : rays) {
+            sum += body(ray);
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    size_t sphereCount = spheres.shapes.size();
+    size_t triangleCount = triangles.shapes.size();
+    double scalarSum, blockSum;
+    double sphereScalar = timeLoop([&](const Ray& ray) {
+        double sum = 0.0;
+        for (size_t i = 0; i < sphereCount; ++i) {
+            float distance;
+            if (intersectSphere(ray, Vector3(spheres.centerX[i], spheres.centerY[i], spheres.centerZ[i]),
+                                spheres.radiusSquared[i], distance)) {
+                sum += distance;
+            }
+        }
+        return sum;
+    }, scalarSum);
+    double sphereBlock = timeLoop([&](const Ray& ray) {
+        double sum = 0.0;
+        float distances[kBlockSize];
+        for (size_t first = 0; first < sphereCount; first += kBlockSize) {
+            int mask = intersectSphereBlock(ray, &spheres.centerX[first], &spheres.centerY[first],
+                                            &spheres.centerZ[first], &spheres.radiusSquared[first], distances);
+            for (int lane = 0; lane < kBlockSize && first + lane < sphereCount; ++lane) {
+                if (mask & (1 << lane)) {
+                    sum += distances[lane];
+                }
+            }
+        }
+        return sum;
+    }, blockSum);
+    bool sphereMatch = scalarSum == blockSum;
+    double triangleScalar = timeLoop([&](const Ray& ray) {
+        double sum = 0.0;
+        for (size_t i = 0; i < triangleCount; ++i) {
+            float distance;
+            if (intersectTriangle(ray, Vector3(triangles.v0x[i], triangles.v0y[i], triangles.v0z[i]),
+                                  Vector3(triangles.edge1x[i], triangles.edge1y[i], triangles.edge1z[i]),
+                                  Vector3(triangles.edge2x[i], triangles.edge2y[i], triangles.edge2z[i]), distance)) {
+                sum += distance;
+            }
+        }
+        return sum;
+    }, scalarSum);
+    double triangleBlock = timeLoop([&](const Ray& ray) {
+        double sum = 0.0;
+        float distances[kBlockSize];
+        for (size_t first = 0; first < triangleCount; first += kBlockSize) {
+            int mask = intersectTriangleBlock(ray, &triangles.v0x[first], &triangles.v0y[first], &triangles.v0z[first],
+                                              &triangles.edge1x[first], &triangles.edge1y[first],
+                                              &triangles.edge1z[first], &triangles.edge2x[first],
+                                              &triangles.edge2y[first], &triangles.edge2z[first], distances);
+            for (int lane = 0; lane < kBlockSize && first + lane < triangleCount; ++lane) {
+                if (mask & (1 << lane)) {
+                    sum += distances[lane];
+                }
+            }
+        }
+        return sum;
+    }, blockSum);
+    bool triangleMatch = scalarSum == blockSum;
+
+    std::printf("%-10s %8s %14s %14s %8s\n", "kernel", "shapes", "single Mt/s", "block Mt/s", "same");
+    std::printf("%-10s %8zu %14.2f %14.2f %8s\n", "sphere", sphereCount, rays.size() * sphereCount / sphereScalar * 1e-6,
+                rays.size() * sphereCount / sphereBlock * 1e-6, sphereMatch ? "yes" : "NO");
+    std::printf("%-10s %8zu %14.2f %14.2f %8s\n", "triangle", triangleCount,
+                rays.size() * triangleCount / triangleScalar * 1e-6, rays.size() * triangleCount / triangleBlock * 1e-6,
+                triangleMatch ? "yes" : "NO");
+    return 0;
+}
+}
+
+int main(int argc, char** argv) {
+    if (argc == 3 && std::string(argv[1]) == "--math") {
+        return benchMath(argv[2]);
+    }
+    if (argc == 3 && std::string(argv[1]) == "--kernels") {
+        return benchKernels(argv[2]);
+    }
+    if (argc < 2) {
+        std::fprintf(stderr, "Usage: %s <scene.json> [accelerator ...]\n       %s --math|--kernels <scene.json>\n",
+                     argv[0], argv[0]);
+        return 1;
+    }
+    std::vector<std::string> types(argv + 2, argv + argc);
+    if (types.empty()) {
+        types = {"brute", "bvh", "sbvh", "lbvh", "hlbvh", "bvh4", "bvh8", "qbvh", "grid", "hgrid", "kdtree"};
+    }
+
+    std::printf("%-8s %10s %10s %14s %14s %14s %10s\n", "accel", "build ms", "memory KB", "primary Mr/s",
+                "packet Mr/s", "shadow Mr/s", "render ms");
+    for (const std::string& type : types) {
+        Renderer renderer;
+        renderer.acceleratorType = type;
+        renderer.useAcceleratorCache = false;
+        renderer.loadFromJSON(argv[1]);
+        if (!renderer.accelerator || type != renderer.accelerator->name()) {
+            std::fprintf(stderr, "Skipping unknown accelerator %s\n", type.c_str());
+            continue;
+        }
+        const Accelerator& accelerator = *renderer.accelerator;
+        int width = renderer.camera.width;
+        int height = renderer.camera.height;
+
+        // Primary rays, keeping the hit points for the shadow pass
+        std::vector<Vector3> hitPoints;
+        auto start = std::chrono::steady_clock::now();
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                Ray ray = renderer.computeRay(x, y);
+                Hit hit;
+                if (accelerator.intersect(ray, hit)) {
+                    hitPoints.push_back(ray.origin + ray.direction * hit.distance);
+                }
+            }
+        }
+        double primarySeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        const int packetSize = 8;
+        std::vector<Ray> rays;
+        Hit hits[packetSize * packetSize];
+        start = std::chrono::steady_clock::now();
+        for (int tileY = 0; tileY < height; tileY += packetSize) {
+            for (int tileX = 0; tileX < width; tileX += packetSize) {
+                rays.clear();
+                for (int y = tileY; y < std::min(tileY + packetSize, height); ++y) {
+                    for (int x = tileX; x < std::min(tileX + packetSize, width); ++x) {
+                        rays.push_back(renderer.computeRay(x, y));
+                        hits[rays.size() - 1] = Hit();
+                    }
+                }
+                accelerator.intersectPacket(rays.data(), static_cast<int>(rays.size()), hits);
+            }
+        }
+        double packetSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        double shadowSeconds = 0.0;
+        if (!renderer.scene.lights.empty()) {
+            Vector3 lightPosition = renderer.scene.lights[0]->position;
+            start = std::chrono::steady_clock::now();
+            for (const Vector3& point : hitPoints) {
+                Vector3 toLight = lightPosition - point;
+                float distance = std::sqrt(Vector3::dot(toLight, toLight));
+                Vector3 direction = toLight * (1.0f / distance);
+                Ray shadowRay(point + direction * 1e-4f, direction);
+                Shape* blocker = nullptr;
+                accelerator.occluded(shadowRay, distance, blocker);
+            }
+            shadowSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        renderer.render();
+        double primaryRate = width * height / primarySeconds * 1e-6;
+        double packetRate = width * height / packetSeconds * 1e-6;
+        double shadowRate = shadowSeconds > 0.0 ? hitPoints.size() / shadowSeconds * 1e-6 : 0.0;
+        std::printf("%-8s %10.1f %10.1f %14.2f %14.2f %14.2f %10.1f\n", type.c_str(), renderer.buildMilliseconds,
+                    accelerator.memoryUsage() / 1024.0, primaryRate, packetRate, shadowRate, renderer.renderMilliseconds);
+    }
+    return 0;
+}
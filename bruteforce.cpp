@@ -0,0 +1,9 @@
+#include "bruteforce.h"
+
+bool BruteForce::intersect(const Ray& ray, Hit& hit) const {
+    return pool.intersectAll(ray, hit);
+}
+
+bool BruteForce::occluded(const Ray& ray, float tMax, Shape*& blocker) const {
+    return pool.occludedAll(ray, tMax, blocker);
+}
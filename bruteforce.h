@@ -0,0 +1,28 @@
+#ifndef BRUTEFORCE_H
+#define BRUTEFORCE_H
+#include <vector>
+#include "base.h"
+#include "accel.h"
+#include "shapepool.h"
+
+// Tests every shape for every ray, as the renderer did before it had acceleration
+// structures. Building only copies the shapes into per-type pools, which the tests then
+// sweep; the baseline the other accelerators are measured against, and still the fastest
+// choice for a handful of shapes.
+class BruteForce : public Accelerator {
+public:
+    void build(const std::vector<Shape*>& input) override { pool.build(input); }
+    float refit() override {
+        pool.update();
+        return 1.0f;
+    }
+    bool intersect(const Ray& ray, Hit& hit) const override;
+    bool occluded(const Ray& ray, float tMax, Shape*& blocker) const override;
+    size_t memoryUsage() const override { return pool.memoryUsage(); }
+    const char* name() const override { return "brute"; }
+
+private:
+    ShapePool pool;
+};
+
+#endif // BRUTEFORCE_H
@@ -0,0 +1,977 @@
+#include <atomic>
+#include <thread>
+#include "bvh.h"
+#include "intersect.h"
+#include "scenecache.h"
+
+namespace {
+// SAH cost constants: one box test per traversal step vs. one primitive test
+const float kTraversalCost = 1.0f;
+const float kIntersectionCost = 1.0f;
+const int kMaxLeafSize = 8;
+// Depth is capped so traversal can use a fixed-size stack
+const int kMaxDepth = 60;
+const int kStackSize = 64;
+// Centroid bins per axis when evaluating split candidates
+const int kBinCount = 32;
+// Subtrees smaller than this are built on the calling thread; below it the cost of
+// starting a thread outweighs the work
+const int kMinParallelCount = 8192;
+// Spatial splits are only tried where the children of the best object split overlap by
+// more than this fraction of the root's surface area
+const float kSpatialSplitOverlap = 1e-5f;
+const int kSpatialBinCount = 32;
+// Linear builds stop splitting at this many primitives instead of asking the SAH
+const int kLinearLeafSize = 4;
+const int kMortonBits = 30;
+// A hybrid build groups primitives into cells by the top bits of their codes
+const int kCellBits = 12;
+
+// Runs body(chunk, begin, end) over [0, count) in chunks of at least kMinParallelCount
+// items, one thread per chunk
+int chunkCount(int count) {
+    int threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    return std::max(1, std::min(threads, count / kMinParallelCount));
+}
+
+template <typename Body>
+void parallelFor(int count, Body body) {
+    int chunks = chunkCount(count);
+    int chunkSize = (count + chunks - 1) / chunks;
+    std::vector<std::thread> workers;
+    for (int chunk = 1; chunk < chunks; ++chunk) {
+        workers.emplace_back(body, chunk, chunk * chunkSize, std::min(count, (chunk + 1) * chunkSize));
+    }
+    body(0, 0, std::min(count, chunkSize));
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+struct MortonPrim {
+    uint32_t code;
+    int index;
+};
+
+// Stable LSD radix sort on the codes, 8 bits per pass. Each chunk counts its digits, the
+// counts are turned into per-chunk output offsets, and each chunk scatters its own items.
+void radixSort(std::vector<MortonPrim>& items) {
+    int n = static_cast<int>(items.size());
+    int chunks = chunkCount(n);
+    std::vector<MortonPrim> scratch(n);
+    std::vector<int> offsets(chunks * 256);
+    for (int shift = 0; shift < kMortonBits; shift += 8) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        parallelFor(n, [&](int chunk, int begin, int end) {
+            int* counts = &offsets[chunk * 256];
+            for (int i = begin; i < end; ++i) {
+                ++counts[(items[i].code >> shift) & 255];
+            }
+        });
+        int total = 0;
+        for (int digit = 0; digit < 256; ++digit) {
+            for (int chunk = 0; chunk < chunks; ++chunk) {
+                int count = offsets[chunk * 256 + digit];
+                offsets[chunk * 256 + digit] = total;
+                total += count;
+            }
+        }
+        parallelFor(n, [&](int chunk, int begin, int end) {
+            int* next = &offsets[chunk * 256];
+            for (int i = begin; i < end; ++i) {
+                scratch[next[(items[i].code >> shift) & 255]++] = items[i];
+            }
+        });
+        items.swap(scratch);
+    }
+}
+
+AABB overlap(const AABB& a, const AABB& b) {
+    return AABB(Vector3::max(a.min, b.min), Vector3::min(a.max, b.max));
+}
+
+// The part of space between lo and hi along one axis
+AABB slab(int axis, float lo, float hi) {
+    const float inf = std::numeric_limits<float>::infinity();
+    return AABB(Vector3(axis == 0 ? lo : -inf, axis == 1 ? lo : -inf, axis == 2 ? lo : -inf),
+                Vector3(axis == 0 ? hi : inf, axis == 1 ? hi : inf, axis == 2 ? hi : inf));
+}
+
+// Bounds of the part of a triangle between lo and hi along one axis: the vertices inside
+// the slab plus the points where edges cross its planes
+AABB clipTriangle(const Triangle& triangle, int axis, float lo, float hi) {
+    const Vector3 vertices[3] = {triangle.v0, triangle.v1, triangle.v2};
+    AABB box;
+    for (int i = 0; i < 3; ++i) {
+        const Vector3& a = vertices[i];
+        const Vector3& b = vertices[(i + 1) % 3];
+        if (a[axis] >= lo && a[axis] <= hi) {
+            box.expand(a);
+        }
+        for (float plane : {lo, hi}) {
+            if ((a[axis] < plane) != (b[axis] < plane)) {
+                float t = (plane - a[axis]) / (b[axis] - a[axis]);
+                box.expand(a + (b - a) * t);
+            }
+        }
+    }
+    return box;
+}
+}
+
+// State shared by all threads building one tree
+struct BVH::BuildContext {
+    std::atomic<int> nodeCount{0};
+    std::atomic<int> spareThreads{0};
+    // Linear builds: the Morton code of each buildPrims entry, and for hybrid builds the
+    // cells (bounds and centroid, index = cell number) with their primitive ranges
+    std::vector<uint32_t> codes;
+    std::vector<BuildPrim> cells;
+    std::vector<int> cellFirst;
+    std::vector<int> cellCount;
+
+    // Builds the two subtrees of a node over count primitives. The first goes to a new
+    // thread while one is spare; the halves must touch disjoint ranges of buildPrims and
+    // allocate their nodes through nodeCount.
+    template <typename First, typename Second>
+    void fork(int count, First first, Second second) {
+        bool spawn = false;
+        if (count >= kMinParallelCount && spareThreads.load() > 0) {
+            spawn = spareThreads.fetch_sub(1) > 0;
+            if (!spawn) {
+                spareThreads.fetch_add(1);
+            }
+        }
+        if (spawn) {
+            std::thread worker(first);
+            second();
+            worker.join();
+            spareThreads.fetch_add(1);
+        } else {
+            first();
+            second();
+        }
+    }
+};
+
+// State of a (single-threaded) spatial split build
+struct BVH::SpatialContext {
+    std::vector<const Triangle*> triangles;  // Per primitive; null for other shape types
+    std::vector<int> order;                  // Primitive of each leaf reference, in leaf order
+    long long duplicatesLeft = 0;
+    float rootArea = 0.0f;
+
+    // Bounds of the part of a reference between lo and hi along an axis. Only triangles
+    // are clipped exactly; other shapes keep their box, cut to the slab.
+    AABB clip(const BuildPrim& ref, int axis, float lo, float hi) const {
+        AABB box = overlap(ref.bounds, slab(axis, lo, hi));
+        const Triangle* triangle = triangles[ref.index];
+        return triangle ? overlap(clipTriangle(*triangle, axis, lo, hi), box) : box;
+    }
+};
+
+void BVH::clear() {
+    nodes.clear();
+    primitives.clear();
+    builtCost = 0.0f;
+}
+
+void BVH::build(const std::vector<Shape*>& shapes) {
+    clear();
+    if (shapes.empty()) {
+        return;
+    }
+
+    int n = static_cast<int>(shapes.size());
+    buildPrims.resize(n);
+    parallelFor(n, [&](int, int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            buildPrims[i].bounds = shapes[i]->getBounds();
+            buildPrims[i].centroid = buildPrims[i].bounds.centroid();
+            buildPrims[i].index = i;
+        }
+    });
+
+    if (method == Method::Spatial) {
+        // References multiply as primitives are split, so the spatial builder works on
+        // per-node lists and appends leaf references in order
+        SpatialContext context;
+        context.triangles.resize(n);
+        for (int i = 0; i < n; ++i) {
+            if (shapes[i]->type == ShapeType::Triangle) {
+                context.triangles[i] = static_cast<const Triangle*>(shapes[i]);
+            }
+        }
+        context.duplicatesLeft = static_cast<long long>(spatialSplitBudget * n);
+        context.order.reserve(n);
+        nodes.reserve(2 * n - 1);
+        nodes.push_back(Node());
+        subdivideSpatial(context, 0, buildPrims, 0);
+        primitives.resize(context.order.size());
+        for (size_t i = 0; i < context.order.size(); ++i) {
+            primitives[i] = shapes[context.order[i]];
+        }
+    } else {
+        // A binary tree over n leaves never needs more than 2n - 1 nodes. Slots are handed
+        // out through an atomic counter so threads can allocate children without locking.
+        nodes.resize(2 * n - 1);
+        BuildContext context;
+        context.nodeCount = 1;
+        context.spareThreads = static_cast<int>(std::thread::hardware_concurrency()) - 1;
+        if (method == Method::Linear || method == Method::Hybrid) {
+            buildLinear(context);
+        } else {
+            subdivide(context, 0, 0, n, 0);
+        }
+        nodes.resize(context.nodeCount);
+
+        primitives.resize(n);
+        for (int i = 0; i < n; ++i) {
+            primitives[i] = shapes[buildPrims[i].index];
+        }
+    }
+
+    buildPrims.clear();
+    builtCost = sahCost();
+}
+
+float BVH::refit() {
+    if (nodes.empty()) {
+        return 1.0f;
+    }
+    // Children are always stored after their parent, so a reverse sweep visits them first
+    for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; --i) {
+        Node& node = nodes[i];
+        AABB bounds;
+        if (node.isLeaf()) {
+            for (int j = node.leftFirst; j < node.leftFirst + node.count; ++j) {
+                bounds.expand(primitives[j]->getBounds());
+            }
+        } else {
+            bounds.expand(nodes[node.leftFirst].bounds);
+            bounds.expand(nodes[node.leftFirst + 1].bounds);
+        }
+        node.bounds = bounds;
+    }
+    return builtCost > 0.0f ? sahCost() / builtCost : 1.0f;
+}
+
+float BVH::sahCost() const {
+    if (nodes.empty()) {
+        return 0.0f;
+    }
+    float rootArea = nodes[0].bounds.surfaceArea();
+    if (rootArea <= 0.0f) {
+        return kIntersectionCost * static_cast<float>(primitives.size());
+    }
+    float cost = 0.0f;
+    for (const Node& node : nodes) {
+        float area = node.bounds.surfaceArea();
+        cost += node.isLeaf() ? area * kIntersectionCost * node.count : area * kTraversalCost;
+    }
+    return cost / rootArea;
+}
+
+BVH::ObjectSplit BVH::findObjectSplit(const BuildPrim* prims, int count, const AABB& centroidBounds) {
+    // Bin the centroids along all three axes in one pass, then evaluate the split planes
+    // between neighbouring bins. Small nodes get fewer bins, as most would stay empty.
+    ObjectSplit best;
+    int binCount = std::min(kBinCount, std::max(4, count));
+    float scale[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+        scale[axis] = extent > 0.0f ? binCount / extent : 0.0f;
+    }
+    AABB binBounds[3][kBinCount];
+    int binCounts[3][kBinCount] = {};
+    for (int i = 0; i < count; ++i) {
+        for (int axis = 0; axis < 3; ++axis) {
+            int bin = std::min(binCount - 1,
+                               static_cast<int>((prims[i].centroid[axis] - centroidBounds.min[axis]) * scale[axis]));
+            binBounds[axis][bin].expand(prims[i].bounds);
+            ++binCounts[axis][bin];
+        }
+    }
+
+    for (int axis = 0; axis < 3; ++axis) {
+        if (scale[axis] == 0.0f) {
+            continue;
+        }
+        AABB rightBounds[kBinCount];
+        int rightCounts[kBinCount];
+        AABB right;
+        int rightCount = 0;
+        for (int bin = binCount - 1; bin > 0; --bin) {
+            right.expand(binBounds[axis][bin]);
+            rightCount += binCounts[axis][bin];
+            rightBounds[bin] = right;
+            rightCounts[bin] = rightCount;
+        }
+        AABB left;
+        int leftCount = 0;
+        for (int bin = 1; bin < binCount; ++bin) {
+            left.expand(binBounds[axis][bin - 1]);
+            leftCount += binCounts[axis][bin - 1];
+            if (leftCount == 0 || rightCounts[bin] == 0) {
+                continue;
+            }
+            float cost = left.surfaceArea() * leftCount + rightBounds[bin].surfaceArea() * rightCounts[bin];
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = bin;
+                best.left = left;
+                best.right = rightBounds[bin];
+            }
+        }
+    }
+    if (best.axis >= 0) {
+        best.binCount = binCount;
+        best.axisMin = centroidBounds.min[best.axis];
+        best.axisScale = scale[best.axis];
+    }
+    return best;
+}
+
+void BVH::subdivide(BuildContext& context, int nodeIndex, int first, int count, int depth) {
+    const BuildPrim* prims = buildPrims.data() + first;
+    AABB bounds;
+    AABB centroidBounds;
+    for (int i = 0; i < count; ++i) {
+        bounds.expand(prims[i].bounds);
+        centroidBounds.expand(prims[i].centroid);
+    }
+    nodes[nodeIndex].bounds = bounds;
+    nodes[nodeIndex].leftFirst = first;
+    nodes[nodeIndex].count = count;
+    if (count == 1 || depth >= kMaxDepth) {
+        return;
+    }
+
+    ObjectSplit best = findObjectSplit(prims, count, centroidBounds);
+    float parentArea = bounds.surfaceArea();
+    float leafCost = kIntersectionCost * count;
+    float splitCost = parentArea > 0.0f
+        ? kTraversalCost + kIntersectionCost * best.cost / parentArea
+        : leafCost;
+    int split;
+    if (best.axis < 0 || (splitCost >= leafCost && count <= kMaxLeafSize)) {
+        if (best.axis < 0 && count > kMaxLeafSize) {
+            // All centroids coincide; split the range in half to keep leaves small
+            split = count / 2;
+        } else {
+            return;
+        }
+    } else {
+        BuildPrim* begin = buildPrims.data() + first;
+        BuildPrim* middle = std::partition(begin, begin + count, [&](const BuildPrim& prim) {
+            return best.isLeft(prim);
+        });
+        split = static_cast<int>(middle - begin);
+    }
+
+    int leftChild = context.nodeCount.fetch_add(2);
+    nodes[nodeIndex].leftFirst = leftChild;
+    nodes[nodeIndex].count = 0;
+
+    context.fork(count, [&] { subdivide(context, leftChild, first, split, depth + 1); },
+                 [&] { subdivide(context, leftChild + 1, first + split, count - split, depth + 1); });
+
+    // Store the larger child first: any-hit traversal visits it first since it is the
+    // likelier blocker. Closest-hit traversal sorts by distance and is unaffected.
+    if (nodes[leftChild + 1].bounds.surfaceArea() > nodes[leftChild].bounds.surfaceArea()) {
+        std::swap(nodes[leftChild], nodes[leftChild + 1]);
+    }
+}
+
+void BVH::buildLinear(BuildContext& context) {
+    int n = static_cast<int>(buildPrims.size());
+    int chunks = chunkCount(n);
+    std::vector<AABB> chunkBounds(chunks);
+    parallelFor(n, [&](int chunk, int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            chunkBounds[chunk].expand(buildPrims[i].centroid);
+        }
+    });
+    AABB centroidBounds;
+    for (const AABB& box : chunkBounds) {
+        centroidBounds.expand(box);
+    }
+
+    // Codes of the centroids on a 2^10 grid per axis over their bounds
+    Vector3 extent = centroidBounds.extent();
+    Vector3 scale(extent.x > 0.0f ? 1.0f / extent.x : 0.0f, extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+                  extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+    std::vector<MortonPrim> sorted(n);
+    parallelFor(n, [&](int, int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            Vector3 offset = buildPrims[i].centroid - centroidBounds.min;
+            sorted[i].code = mortonCode(Vector3(offset.x * scale.x, offset.y * scale.y, offset.z * scale.z));
+            sorted[i].index = i;
+        }
+    });
+    radixSort(sorted);
+
+    std::vector<BuildPrim> prims(n);
+    context.codes.resize(n);
+    parallelFor(n, [&](int, int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            prims[i] = buildPrims[sorted[i].index];
+            context.codes[i] = sorted[i].code;
+        }
+    });
+    buildPrims.swap(prims);
+
+    if (method == Method::Linear) {
+        emitLinear(context, 0, 0, n, kMortonBits - 1, 0);
+        return;
+    }
+
+    // Cut the curve into cells sharing their top code bits; each becomes a treelet
+    int cellShift = kMortonBits - kCellBits;
+    for (int first = 0; first < n;) {
+        int end = first + 1;
+        while (end < n && (context.codes[end] >> cellShift) == (context.codes[first] >> cellShift)) {
+            ++end;
+        }
+        BuildPrim cell;
+        for (int i = first; i < end; ++i) {
+            cell.bounds.expand(buildPrims[i].bounds);
+        }
+        cell.centroid = cell.bounds.centroid();
+        cell.index = static_cast<int>(context.cells.size());
+        context.cells.push_back(cell);
+        context.cellFirst.push_back(first);
+        context.cellCount.push_back(end - first);
+        first = end;
+    }
+    subdivideCells(context, 0, 0, static_cast<int>(context.cells.size()), 0);
+}
+
+void BVH::emitLinear(BuildContext& context, int nodeIndex, int first, int count, int bit, int depth) {
+    Node& node = nodes[nodeIndex];
+    if (count <= kLinearLeafSize || depth >= kMaxDepth) {
+        AABB bounds;
+        for (int i = first; i < first + count; ++i) {
+            bounds.expand(buildPrims[i].bounds);
+        }
+        node.bounds = bounds;
+        node.leftFirst = first;
+        node.count = count;
+        return;
+    }
+
+    // The codes are sorted, so the range splits where the highest differing bit turns on;
+    // primitives with identical codes are split in half
+    const uint32_t* codes = context.codes.data() + first;
+    int split = count / 2;
+    for (; bit >= 0; --bit) {
+        uint32_t mask = 1u << bit;
+        if ((codes[0] & mask) != (codes[count - 1] & mask)) {
+            split = static_cast<int>(std::partition_point(codes, codes + count,
+                                                          [&](uint32_t code) { return (code & mask) == 0; }) - codes);
+            break;
+        }
+    }
+
+    int leftChild = context.nodeCount.fetch_add(2);
+    context.fork(count, [&] { emitLinear(context, leftChild, first, split, bit - 1, depth + 1); },
+                 [&] { emitLinear(context, leftChild + 1, first + split, count - split, bit - 1, depth + 1); });
+    node.bounds = nodes[leftChild].bounds;
+    node.bounds.expand(nodes[leftChild + 1].bounds);
+    node.leftFirst = leftChild;
+    node.count = 0;
+    // Larger child first, as in subdivide
+    if (nodes[leftChild + 1].bounds.surfaceArea() > nodes[leftChild].bounds.surfaceArea()) {
+        std::swap(nodes[leftChild], nodes[leftChild + 1]);
+    }
+}
+
+void BVH::subdivideCells(BuildContext& context, int nodeIndex, int first, int count, int depth) {
+    BuildPrim* cells = context.cells.data() + first;
+    if (count == 1) {
+        int cell = cells[0].index;
+        emitLinear(context, nodeIndex, context.cellFirst[cell], context.cellCount[cell],
+                   kMortonBits - kCellBits - 1, depth);
+        return;
+    }
+
+    AABB centroidBounds;
+    int primCount = 0;
+    for (int i = 0; i < count; ++i) {
+        centroidBounds.expand(cells[i].centroid);
+        primCount += context.cellCount[cells[i].index];
+    }
+    // Cells are never merged into leaves, so the split is taken whatever its cost
+    ObjectSplit best = findObjectSplit(cells, count, centroidBounds);
+    int split = count / 2;
+    if (best.axis >= 0) {
+        split = static_cast<int>(std::partition(cells, cells + count, [&](const BuildPrim& cell) {
+            return best.isLeft(cell);
+        }) - cells);
+    }
+
+    int leftChild = context.nodeCount.fetch_add(2);
+    context.fork(primCount, [&] { subdivideCells(context, leftChild, first, split, depth + 1); },
+                 [&] { subdivideCells(context, leftChild + 1, first + split, count - split, depth + 1); });
+    Node& node = nodes[nodeIndex];
+    node.bounds = nodes[leftChild].bounds;
+    node.bounds.expand(nodes[leftChild + 1].bounds);
+    node.leftFirst = leftChild;
+    node.count = 0;
+    if (nodes[leftChild + 1].bounds.surfaceArea() > nodes[leftChild].bounds.surfaceArea()) {
+        std::swap(nodes[leftChild], nodes[leftChild + 1]);
+    }
+}
+
+void BVH::subdivideSpatial(SpatialContext& context, int nodeIndex, std::vector<BuildPrim>& refs, int depth) {
+    int count = static_cast<int>(refs.size());
+    AABB bounds;
+    AABB centroidBounds;
+    for (const BuildPrim& ref : refs) {
+        bounds.expand(ref.bounds);
+        centroidBounds.expand(ref.centroid);
+    }
+    if (nodeIndex == 0) {
+        context.rootArea = bounds.surfaceArea();
+    }
+    nodes[nodeIndex].bounds = bounds;
+
+    ObjectSplit object = count > 1 && depth < kMaxDepth
+        ? findObjectSplit(refs.data(), count, centroidBounds)
+        : ObjectSplit();
+
+    // Try splitting along a plane where the object split leaves overlapping children
+    float spatialCost = std::numeric_limits<float>::max();
+    int spatialAxis = -1;
+    float spatialPosition = 0.0f;
+    AABB spatialLeft, spatialRight;
+    int spatialLeftCount = 0, spatialRightCount = 0;
+    if (object.axis >= 0 && context.duplicatesLeft > 0 &&
+        overlap(object.left, object.right).surfaceArea() > kSpatialSplitOverlap * context.rootArea) {
+        for (int axis = 0; axis < 3; ++axis) {
+            float axisMin = bounds.min[axis];
+            float binWidth = (bounds.max[axis] - axisMin) / kSpatialBinCount;
+            if (binWidth <= 0.0f) {
+                continue;
+            }
+            // Each reference is clipped into every bin it spans; it enters the split
+            // candidates left of its first bin and leaves right of its last one
+            AABB binBounds[kSpatialBinCount];
+            int entries[kSpatialBinCount] = {};
+            int exits[kSpatialBinCount] = {};
+            for (const BuildPrim& ref : refs) {
+                int firstBin = std::max(0, std::min(kSpatialBinCount - 1,
+                                                    static_cast<int>((ref.bounds.min[axis] - axisMin) / binWidth)));
+                int lastBin = std::max(firstBin, std::min(kSpatialBinCount - 1,
+                                                          static_cast<int>((ref.bounds.max[axis] - axisMin) / binWidth)));
+                for (int bin = firstBin; bin <= lastBin; ++bin) {
+                    float lo = axisMin + binWidth * bin;
+                    float hi = bin == kSpatialBinCount - 1 ? bounds.max[axis] : lo + binWidth;
+                    binBounds[bin].expand(firstBin == lastBin ? ref.bounds : context.clip(ref, axis, lo, hi));
+                }
+                ++entries[firstBin];
+                ++exits[lastBin];
+            }
+            AABB rightBounds[kSpatialBinCount];
+            int rightCounts[kSpatialBinCount];
+            AABB right;
+            int rightCount = 0;
+            for (int bin = kSpatialBinCount - 1; bin > 0; --bin) {
+                right.expand(binBounds[bin]);
+                rightCount += exits[bin];
+                rightBounds[bin] = right;
+                rightCounts[bin] = rightCount;
+            }
+            AABB left;
+            int leftCount = 0;
+            for (int bin = 1; bin < kSpatialBinCount; ++bin) {
+                left.expand(binBounds[bin - 1]);
+                leftCount += entries[bin - 1];
+                if (leftCount == 0 || rightCounts[bin] == 0) {
+                    continue;
+                }
+                float cost = left.surfaceArea() * leftCount + rightBounds[bin].surfaceArea() * rightCounts[bin];
+                if (cost < spatialCost) {
+                    spatialCost = cost;
+                    spatialAxis = axis;
+                    spatialPosition = axisMin + binWidth * bin;
+                    spatialLeft = left;
+                    spatialRight = rightBounds[bin];
+                    spatialLeftCount = leftCount;
+                    spatialRightCount = rightCounts[bin];
+                }
+            }
+        }
+    }
+
+    float bestCost = std::min(object.cost, spatialCost);
+    float parentArea = bounds.surfaceArea();
+    float leafCost = kIntersectionCost * count;
+    float splitCost = parentArea > 0.0f
+        ? kTraversalCost + kIntersectionCost * bestCost / parentArea
+        : leafCost;
+    bool makeLeaf = count == 1 || depth >= kMaxDepth ||
+        (object.axis < 0 && count <= kMaxLeafSize) ||
+        (object.axis >= 0 && splitCost >= leafCost && count <= kMaxLeafSize);
+
+    std::vector<BuildPrim> leftRefs, rightRefs;
+    if (!makeLeaf && spatialCost < object.cost) {
+        // Send each straddling reference to whichever side is cheapest: clipped into both,
+        // or whole into one side when that costs less than the extra reference
+        // (reference unsplitting). Once the budget is spent references are never split.
+        int axis = spatialAxis;
+        std::vector<const BuildPrim*> straddling;
+        for (const BuildPrim& ref : refs) {
+            if (ref.bounds.max[axis] <= spatialPosition) {
+                leftRefs.push_back(ref);
+            } else if (ref.bounds.min[axis] >= spatialPosition) {
+                rightRefs.push_back(ref);
+            } else {
+                straddling.push_back(&ref);
+            }
+        }
+        for (const BuildPrim* ref : straddling) {
+            const float inf = std::numeric_limits<float>::infinity();
+            AABB leftPart = context.clip(*ref, axis, -inf, spatialPosition);
+            AABB rightPart = context.clip(*ref, axis, spatialPosition, inf);
+            AABB leftWhole = spatialLeft;
+            AABB rightWhole = spatialRight;
+            leftWhole.expand(ref->bounds);
+            rightWhole.expand(ref->bounds);
+            float leftArea = spatialLeft.surfaceArea();
+            float rightArea = spatialRight.surfaceArea();
+            float splitRefCost = leftArea * spatialLeftCount + rightArea * spatialRightCount;
+            float leftOnlyCost = leftWhole.surfaceArea() * spatialLeftCount + rightArea * (spatialRightCount - 1);
+            float rightOnlyCost = leftArea * (spatialLeftCount - 1) + rightWhole.surfaceArea() * spatialRightCount;
+            bool canSplit = context.duplicatesLeft > 0 && !leftPart.isEmpty() && !rightPart.isEmpty();
+            if (canSplit && splitRefCost <= leftOnlyCost && splitRefCost <= rightOnlyCost) {
+                BuildPrim part = *ref;
+                part.bounds = leftPart;
+                part.centroid = leftPart.centroid();
+                leftRefs.push_back(part);
+                part.bounds = rightPart;
+                part.centroid = rightPart.centroid();
+                rightRefs.push_back(part);
+                --context.duplicatesLeft;
+            } else if (leftOnlyCost <= rightOnlyCost) {
+                leftRefs.push_back(*ref);
+                spatialLeft = leftWhole;
+                --spatialRightCount;
+            } else {
+                rightRefs.push_back(*ref);
+                spatialRight = rightWhole;
+                --spatialLeftCount;
+            }
+        }
+        if (leftRefs.empty() || rightRefs.empty()) {
+            leftRefs.clear();
+            rightRefs.clear();
+        }
+    }
+    if (!makeLeaf && leftRefs.empty()) {
+        if (object.axis >= 0) {
+            for (const BuildPrim& ref : refs) {
+                (object.isLeft(ref) ? leftRefs : rightRefs).push_back(ref);
+            }
+        } else {
+            // All centroids coincide; split the list in half to keep leaves small
+            leftRefs.assign(refs.begin(), refs.begin() + count / 2);
+            rightRefs.assign(refs.begin() + count / 2, refs.end());
+        }
+    }
+
+    if (makeLeaf) {
+        nodes[nodeIndex].leftFirst = static_cast<int>(context.order.size());
+        nodes[nodeIndex].count = count;
+        for (const BuildPrim& ref : refs) {
+            context.order.push_back(ref.index);
+        }
+        return;
+    }
+
+    // The parent's list is no longer needed; free it before descending
+    std::vector<BuildPrim>().swap(refs);
+    int leftChild = static_cast<int>(nodes.size());
+    nodes.push_back(Node());
+    nodes.push_back(Node());
+    nodes[nodeIndex].leftFirst = leftChild;
+    nodes[nodeIndex].count = 0;
+    subdivideSpatial(context, leftChild, leftRefs, depth + 1);
+    subdivideSpatial(context, leftChild + 1, rightRefs, depth + 1);
+
+    // Larger child first, as in subdivide
+    if (nodes[leftChild + 1].bounds.surfaceArea() > nodes[leftChild].bounds.surfaceArea()) {
+        std::swap(nodes[leftChild], nodes[leftChild + 1]);
+    }
+}
+
+const char* BVH::name() const {
+    switch (method) {
+    case Method::Spatial:
+        return "sbvh";
+    case Method::Linear:
+        return "lbvh";
+    case Method::Hybrid:
+        return "hlbvh";
+    default:
+        return "bvh";
+    }
+}
+
+bool BVH::saveCache(CacheWriter& out, const std::vector<Shape*>& shapes) const {
+    out.write(builtCost);
+    out.write(nodes);
+    out.writeShapes(primitives, shapes);
+    return true;
+}
+
+bool BVH::loadCache(CacheReader& in, const std::vector<Shape*>& shapes) {
+    clear();
+    if (!in.read(builtCost) || !in.read(nodes) || !in.readShapes(primitives, shapes)) {
+        clear();
+        return false;
+    }
+    // Reject child and primitive ranges that would index out of bounds
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const Node& node = nodes[i];
+        bool valid = node.isLeaf()
+            ? node.leftFirst >= 0 && node.leftFirst + node.count <= static_cast<int>(primitives.size())
+            : node.leftFirst > static_cast<int>(i) && node.leftFirst + 1 < static_cast<int>(nodes.size());
+        if (!valid) {
+            clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t BVH::memoryUsage() const {
+    return nodes.size() * sizeof(Node) + primitives.size() * sizeof(Shape*);
+}
+
+bool BVH::intersect(const Ray& ray, Hit& hit) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    Vector3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    float tNear;
+    if (!nodes[0].bounds.intersect(ray, invDir, hit.distance, tNear)) {
+        return false;
+    }
+
+    bool found = false;
+    int stack[kStackSize];
+    float stackNear[kStackSize];
+    int stackSize = 0;
+    int nodeIndex = 0;
+    while (true) {
+        const Node& node = nodes[nodeIndex];
+        if (node.isLeaf()) {
+            for (int i = node.leftFirst; i < node.leftFirst + node.count; ++i) {
+                if (intersectPrimitive(ray, primitives[i], hit)) {
+                    found = true;
+                }
+            }
+        } else {
+            // Visit the nearer child first and defer the farther one
+            int near = node.leftFirst;
+            int far = node.leftFirst + 1;
+            float tLeft, tRight;
+            bool hitLeft = nodes[near].bounds.intersect(ray, invDir, hit.distance, tLeft);
+            bool hitRight = nodes[far].bounds.intersect(ray, invDir, hit.distance, tRight);
+            if (hitLeft && hitRight) {
+                if (tRight < tLeft) {
+                    std::swap(near, far);
+                    std::swap(tLeft, tRight);
+                }
+                stackNear[stackSize] = tRight;
+                stack[stackSize++] = far;
+                nodeIndex = near;
+                continue;
+            }
+            if (hitLeft || hitRight) {
+                nodeIndex = hitLeft ? near : far;
+                continue;
+            }
+        }
+        // Pop the next deferred node, skipping any that start beyond the closest hit so far
+        do {
+            if (stackSize == 0) {
+                return found;
+            }
+            --stackSize;
+        } while (stackNear[stackSize] > hit.distance);
+        nodeIndex = stack[stackSize];
+    }
+}
+
+void BVH::intersectPacket(const Ray* rays, int count, Hit* hits) const {
+    if (nodes.empty()) {
+        return;
+    }
+    // The frustum test needs a common origin, and an axis along which directions change
+    // sign gives it no bound; with more than one such axis it prunes almost nothing
+    bool sharedOrigin = true;
+    Vector3 dirMin = rays[0].direction;
+    Vector3 dirMax = rays[0].direction;
+    for (int i = 1; i < count; ++i) {
+        const Vector3& o = rays[i].origin;
+        sharedOrigin = sharedOrigin && o.x == rays[0].origin.x && o.y == rays[0].origin.y && o.z == rays[0].origin.z;
+        dirMin = Vector3::min(dirMin, rays[i].direction);
+        dirMax = Vector3::max(dirMax, rays[i].direction);
+    }
+    int mixedAxes = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+        mixedAxes += dirMin[axis] <= 0.0f && dirMax[axis] >= 0.0f;
+    }
+    if (count == 1 || count > kMaxPacketSize || !sharedOrigin || mixedAxes > 1) {
+        for (int i = 0; i < count; ++i) {
+            intersect(rays[i], hits[i]);
+        }
+        return;
+    }
+
+    // Reciprocal direction interval per axis; an axis is only usable when its directions
+    // all have the same sign
+    const Vector3& origin = rays[0].origin;
+    bool usable[3];
+    bool positive[3];
+    float invLo[3], invHi[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        usable[axis] = dirMin[axis] > 0.0f || dirMax[axis] < 0.0f;
+        positive[axis] = dirMin[axis] > 0.0f;
+        invLo[axis] = std::min(1.0f / dirMin[axis], 1.0f / dirMax[axis]);
+        invHi[axis] = std::max(1.0f / dirMin[axis], 1.0f / dirMax[axis]);
+    }
+    Vector3 invDirs[kMaxPacketSize];
+    float maxDistance = 0.0f;
+    for (int i = 0; i < count; ++i) {
+        const Vector3& d = rays[i].direction;
+        invDirs[i] = Vector3(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+        maxDistance = std::max(maxDistance, hits[i].distance);
+    }
+    // Interval bounds on the entry and exit distances of every ray in the packet: if the
+    // latest possible exit precedes the earliest possible entry, all rays miss the box
+    auto frustumMisses = [&](const AABB& box) {
+        float enterLo = 0.0f;
+        float exitHi = maxDistance;
+        for (int axis = 0; axis < 3; ++axis) {
+            if (!usable[axis]) {
+                continue;
+            }
+            float nearPlane = (positive[axis] ? box.min[axis] : box.max[axis]) - origin[axis];
+            float farPlane = (positive[axis] ? box.max[axis] : box.min[axis]) - origin[axis];
+            enterLo = std::max(enterLo, std::min(nearPlane * invLo[axis], nearPlane * invHi[axis]));
+            exitHi = std::min(exitHi, std::max(farPlane * invLo[axis], farPlane * invHi[axis]));
+        }
+        return enterLo > exitHi;
+    };
+
+    struct PacketEntry {
+        int node;
+        int firstActive;  // Rays before this one are known to miss the node
+    };
+    PacketEntry stack[kStackSize];
+    int stackSize = 0;
+    int nodeIndex = 0;
+    int firstActive = 0;
+    while (true) {
+        const Node& node = nodes[nodeIndex];
+        float tNear;
+        bool visit = !frustumMisses(node.bounds);
+        if (visit) {
+            while (firstActive < count &&
+                   !node.bounds.intersect(rays[firstActive], invDirs[firstActive], hits[firstActive].distance, tNear)) {
+                ++firstActive;
+            }
+            visit = firstActive < count;
+        }
+        if (visit && node.isLeaf()) {
+            for (int i = firstActive; i < count; ++i) {
+                if (!node.bounds.intersect(rays[i], invDirs[i], hits[i].distance, tNear)) {
+                    continue;
+                }
+                for (int j = node.leftFirst; j < node.leftFirst + node.count; ++j) {
+                    intersectPrimitive(rays[i], primitives[j], hits[i]);
+                }
+            }
+            maxDistance = 0.0f;
+            for (int i = 0; i < count; ++i) {
+                maxDistance = std::max(maxDistance, hits[i].distance);
+            }
+        } else if (visit) {
+            // Order the children by where the first active ray enters them
+            const Ray& ray = rays[firstActive];
+            float maxT = hits[firstActive].distance;
+            int near = node.leftFirst;
+            int far = node.leftFirst + 1;
+            float tLeft, tRight;
+            if (!nodes[near].bounds.intersect(ray, invDirs[firstActive], maxT, tLeft)) {
+                tLeft = std::numeric_limits<float>::max();
+            }
+            if (!nodes[far].bounds.intersect(ray, invDirs[firstActive], maxT, tRight)) {
+                tRight = std::numeric_limits<float>::max();
+            }
+            if (tRight < tLeft) {
+                std::swap(near, far);
+            }
+            stack[stackSize++] = {far, firstActive};
+            nodeIndex = near;
+            continue;
+        }
+        if (stackSize == 0) {
+            return;
+        }
+        --stackSize;
+        nodeIndex = stack[stackSize].node;
+        firstActive = stack[stackSize].firstActive;
+    }
+}
+
+bool BVH::occluded(const Ray& ray, float tMax, Shape*& blocker) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    Vector3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    float tNear;
+    if (!nodes[0].bounds.intersect(ray, invDir, tMax, tNear)) {
+        return false;
+    }
+
+    // Depth-first in storage order (larger child first), returning at the first blocker
+    int stack[kStackSize];
+    int stackSize = 0;
+    int nodeIndex = 0;
+    while (true) {
+        const Node& node = nodes[nodeIndex];
+        if (node.isLeaf()) {
+            for (int i = node.leftFirst; i < node.leftFirst + node.count; ++i) {
+                if (occludedPrimitive(ray, primitives[i], tMax)) {
+                    blocker = primitives[i];
+                    return true;
+                }
+            }
+        } else {
+            int first = node.leftFirst;
+            int second = node.leftFirst + 1;
+            bool hitFirst = nodes[first].bounds.intersect(ray, invDir, tMax, tNear);
+            bool hitSecond = nodes[second].bounds.intersect(ray, invDir, tMax, tNear);
+            if (hitFirst) {
+                if (hitSecond) {
+                    stack[stackSize++] = second;
+                }
+                nodeIndex = first;
+                continue;
+            }
+            if (hitSecond) {
+                nodeIndex = second;
+                continue;
+            }
+        }
+        if (stackSize == 0) {
+            return false;
+        }
+        nodeIndex = stack[--stackSize];
+    }
+}
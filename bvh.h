@@ -0,0 +1,116 @@
+#ifndef BVH_H
+#define BVH_H
+#include <vector>
+#include "base.h"
+#include "accel.h"
+
+// Bounding volume hierarchy over the scene shapes, built with the binned surface area
+// heuristic. Large subtrees are built on worker threads. With a spatial split budget the
+// tree is built as an SBVH instead: a node may also split along a plane, clipping the
+// primitives that straddle it into both children, which keeps large triangles (ground
+// planes) from inflating every box they overlap. For per-frame rebuilds it can be built as
+// an LBVH instead: primitives are sorted along a Morton curve and the tree follows the bits
+// of their codes, optionally with an SAH-built top (HLBVH). Nodes live in one flat array;
+// the two children of an interior node are stored next to each other, and each leaf
+// references a contiguous range of the reordered primitive list.
+class BVH : public Accelerator {
+public:
+    // How build() constructs the hierarchy
+    enum class Method {
+        SAH,      // Binned SAH over object splits
+        Spatial,  // SBVH, spatial splits within spatialSplitBudget
+        Linear,   // LBVH, split where the Morton codes of the primitive centroids change
+        Hybrid    // HLBVH, LBVH treelets over 12-bit Morton cells joined by binned SAH
+    };
+
+    struct Node {
+        AABB bounds;
+        int leftFirst;  // Left child index for interior nodes, first primitive for leaves
+        int count;      // Number of primitives in a leaf, 0 for interior nodes
+
+        bool isLeaf() const { return count > 0; }
+    };
+
+    // For Method::Spatial, spatialSplitBudget bounds the extra primitive references spatial
+    // splits may create, as a fraction of the primitive count; with 0 the SBVH builder
+    // still runs but only makes object splits
+    explicit BVH(Method method = Method::SAH, float spatialSplitBudget = 0.0f)
+        : method(method), spatialSplitBudget(spatialSplitBudget > 0.0f ? spatialSplitBudget : 0.0f) {}
+
+    void build(const std::vector<Shape*>& shapes) override;
+    void clear();
+
+    // Recomputes node bounds bottom-up from the current shape positions, keeping the
+    // topology. Leaves of an SBVH fall back to unclipped primitive bounds. Returns the SAH
+    // cost of the refitted tree relative to its cost when it was built, so callers can
+    // decide when a rebuild pays off.
+    float refit() override;
+    // Expected cost of a random ray query, in primitive-test units
+    float sahCost() const;
+
+    // Finds the closest shape along the ray; hit.distance acts as the upper bound on entry
+    bool intersect(const Ray& ray, Hit& hit) const override;
+    // Traverses the tree once for the whole packet. Nodes are culled with an interval
+    // arithmetic frustum test and, past that, by the first ray that still hits them.
+    // Rays with different origins or directions spread over several octants are traced
+    // singly instead.
+    void intersectPacket(const Ray* rays, int count, Hit* hits) const override;
+    size_t memoryUsage() const override;
+    bool occluded(const Ray& ray, float tMax, Shape*& blocker) const override;
+    const char* name() const override;
+    bool saveCache(CacheWriter& out, const std::vector<Shape*>& shapes) const override;
+    bool loadCache(CacheReader& in, const std::vector<Shape*>& shapes) override;
+
+    bool empty() const { return nodes.empty(); }
+    const AABB& bounds() const { return nodes[0].bounds; }
+    const std::vector<Node>& getNodes() const { return nodes; }
+    const std::vector<Shape*>& getPrimitives() const { return primitives; }
+
+private:
+    Method method;
+    float spatialSplitBudget;
+    std::vector<Node> nodes;
+    std::vector<Shape*> primitives;
+    float builtCost = 0.0f;
+
+    // Per-primitive data used only while building. Entries are partitioned in place, so
+    // each subtree reads a contiguous range instead of chasing indices.
+    struct BuildPrim {
+        AABB bounds;
+        Vector3 centroid;
+        int index;
+    };
+    std::vector<BuildPrim> buildPrims;
+
+    // Best binned object split of a primitive range; axis is -1 when no plane separates
+    // the centroids
+    struct ObjectSplit {
+        float cost = std::numeric_limits<float>::max();
+        int axis = -1;
+        int bin = 0;
+        int binCount = 0;
+        float axisMin = 0.0f;
+        float axisScale = 0.0f;
+        AABB left, right;
+
+        bool isLeft(const BuildPrim& prim) const {
+            return std::min(binCount - 1, static_cast<int>((prim.centroid[axis] - axisMin) * axisScale)) < bin;
+        }
+    };
+    static ObjectSplit findObjectSplit(const BuildPrim* prims, int count, const AABB& centroidBounds);
+
+    struct BuildContext;
+    void subdivide(BuildContext& context, int nodeIndex, int first, int count, int depth);
+    struct SpatialContext;
+    void subdivideSpatial(SpatialContext& context, int nodeIndex, std::vector<BuildPrim>& refs, int depth);
+
+    // Linear builds: sorts buildPrims by Morton code, then emits the tree
+    void buildLinear(BuildContext& context);
+    // Splits a range of Morton-sorted primitives at the highest bit, from bit down, on
+    // which their codes differ
+    void emitLinear(BuildContext& context, int nodeIndex, int first, int count, int bit, int depth);
+    // SAH top of a hybrid build over a range of Morton cells, each becoming an LBVH treelet
+    void subdivideCells(BuildContext& context, int nodeIndex, int first, int count, int depth);
+};
+
+#endif // BVH_H
@@ -0,0 +1,119 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include "cpu.h"
+#include "simd.h"
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+namespace {
+const char* const kIsaNames[] = {"scalar", "sse2", "sse4.2", "avx2", "avx512"};
+
+#if defined(RT_DISPATCH)
+void cpuid(int leaf, int subleaf, uint32_t registers[4]) {
+#if defined(_MSC_VER)
+    int values[4];
+    __cpuidex(values, leaf, subleaf);
+    for (int i = 0; i < 4; ++i) {
+        registers[i] = static_cast<uint32_t>(values[i]);
+    }
+#else
+    __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+// Register state the operating system saves on context switches (XCR0)
+uint64_t enabledStateMask() {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t low, high;
+    __asm__("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+    return (static_cast<uint64_t>(high) << 32) | low;
+#endif
+}
+#endif
+
+// Highest level compiled into this binary
+Isa builtIsa() {
+#if defined(RT_DISPATCH)
+    return Isa::AVX512;
+#elif defined(RT_SSE)
+    return Isa::SSE2;
+#else
+    return Isa::Scalar;
+#endif
+}
+}
+
+const char* isaName(Isa isa) {
+    return kIsaNames[static_cast<int>(isa)];
+}
+
+Isa detectIsa() {
+#if defined(RT_DISPATCH)
+    uint32_t registers[4];  // eax, ebx, ecx, edx
+    cpuid(0, 0, registers);
+    uint32_t maxLeaf = registers[0];
+    cpuid(1, 0, registers);
+    uint32_t features = registers[2];
+    if (!(registers[3] & (1u << 26))) {
+        return Isa::Scalar;
+    }
+    if (!(features & (1u << 20))) {
+        return Isa::SSE2;
+    }
+    // AVX state needs OS support (OSXSAVE, then XCR0 saving the SSE and AVX registers)
+    const bool osSavesAvx = (features & (1u << 27)) && (features & (1u << 28)) && (enabledStateMask() & 0x6) == 0x6;
+    if (!osSavesAvx || maxLeaf < 7) {
+        return Isa::SSE42;
+    }
+    cpuid(7, 0, registers);
+    uint32_t extended = registers[1];
+    // The AVX2 level also includes F16C, which every AVX2 CPU has, for the half-float kernels
+    if (!(extended & (1u << 5)) || !(features & (1u << 29))) {
+        return Isa::SSE42;
+    }
+    // AVX-512 foundation, and the opmask and upper ZMM state saved as well
+    if ((extended & (1u << 16)) && (enabledStateMask() & 0xe0) == 0xe0) {
+        return Isa::AVX512;
+    }
+    return Isa::AVX2;
+#else
+    return builtIsa();
+#endif
+}
+
+Isa selectedIsa() {
+    static const Isa selected = [] {
+        Isa detected = detectIsa();
+        Isa isa = detected < builtIsa() ? detected : builtIsa();
+        const char* requested = std::getenv("RT_ISA");
+        if (requested != nullptr && *requested != '\0') {
+            bool known = false;
+            for (int level = 0; level <= static_cast<int>(Isa::AVX512); ++level) {
+                if (std::strcmp(requested, kIsaNames[level]) == 0) {
+                    known = true;
+                    if (static_cast<Isa>(level) < isa) {
+                        isa = static_cast<Isa>(level);
+                    }
+                }
+            }
+            if (!known) {
+                std::fprintf(stderr, "Ignoring unknown RT_ISA=%s\n", requested);
+            }
+        }
+        std::printf("SIMD level: %s (CPU supports %s%s%s)\n", isaName(isa), isaName(detected),
+                    requested != nullptr && *requested != '\0' ? ", RT_ISA=" : "", requested != nullptr ? requested : "");
+        return isa;
+    }();
+    return selected;
+}
+
+void logKernelVariant(const char* family, Isa variant) {
+    std::printf("SIMD kernels: %s use %s\n", family, isaName(variant));
+}
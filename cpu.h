@@ -0,0 +1,35 @@
+#ifndef CPU_H
+#define CPU_H
+
+// Instruction set levels the SIMD kernels are built for, in increasing order. Each
+// level includes the ones below it; a kernel with no variant for a level runs its
+// variant for the next lower one.
+enum class Isa {
+    Scalar,
+    SSE2,
+    SSE42,
+    AVX2,
+    AVX512
+};
+
+const char* isaName(Isa isa);
+
+// Highest level this CPU and operating system support, read with cpuid
+Isa detectIsa();
+
+// Level the kernels may use, decided on the first call: the detected level, lowered by
+// the RT_ISA environment variable (scalar, sse2, sse4.2, avx2 or avx512) when it names a
+// lower one, and never above what the build contains. Logs the choice once.
+Isa selectedIsa();
+
+// Logs the variant a kernel family runs, which is below selectedIsa() when the family
+// has no variant for that level, and returns its kernel. Each family's dispatcher calls
+// this once.
+void logKernelVariant(const char* family, Isa variant);
+template <typename Kernel>
+Kernel chooseKernel(const char* family, Isa variant, Kernel kernel) {
+    logKernelVariant(family, variant);
+    return kernel;
+}
+
+#endif // CPU_H
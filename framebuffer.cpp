@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <new>
+#include <numeric>
+#include <utility>
+#include <vector>
+#include "framebuffer.h"
+
+namespace {
+// Smallest pixel count that fills whole cache lines
+size_t pixelsPerLine(size_t pixelBytes) {
+    return Framebuffer::kAlignment / std::gcd(Framebuffer::kAlignment, pixelBytes);
+}
+
+size_t roundUp(size_t count, size_t multiple) {
+    return (count + multiple - 1) / multiple * multiple;
+}
+
+unsigned char* allocatePixels(size_t bytes) {
+    return static_cast<unsigned char*>(::operator new(bytes, std::align_val_t(Framebuffer::kAlignment)));
+}
+
+void freePixels(unsigned char* pixels) {
+    ::operator delete(pixels, std::align_val_t(Framebuffer::kAlignment));
+}
+}
+
+Framebuffer::Framebuffer(int width, int height, Layout layout, int tileSize, Format format)
+    : imageWidth(width), imageHeight(height), pixelLayout(layout), pixelFormat(format),
+      tileExtent(std::max(1, tileSize)) {
+    if (width <= 0 || height <= 0) {
+        imageWidth = imageHeight = 0;
+        return;
+    }
+    size_t linePixels = pixelsPerLine(pixelSize(format));
+    if (layout == Layout::RowMajor) {
+        rowStride = roundUp(width, linePixels);
+        pixelCount = rowStride * height;
+    } else {
+        tileStride = roundUp(static_cast<size_t>(tileExtent) * tileExtent, linePixels);
+        pixelCount = tileStride * tilesX() * tilesY();
+    }
+    pixels = allocatePixels(memoryUsage());
+    fill(Color());
+}
+
+Framebuffer::~Framebuffer() {
+    if (pixels != nullptr) {
+        freePixels(pixels);
+    }
+}
+
+Framebuffer::Framebuffer(const Framebuffer& other)
+    : pixelCount(other.pixelCount), imageWidth(other.imageWidth), imageHeight(other.imageHeight),
+      pixelLayout(other.pixelLayout), pixelFormat(other.pixelFormat), tileExtent(other.tileExtent),
+      rowStride(other.rowStride), tileStride(other.tileStride) {
+    if (other.pixels != nullptr) {
+        pixels = allocatePixels(memoryUsage());
+        std::memcpy(pixels, other.pixels, memoryUsage());
+    }
+}
+
+Framebuffer::Framebuffer(Framebuffer&& other) noexcept {
+    swap(other);
+}
+
+Framebuffer& Framebuffer::operator=(Framebuffer other) noexcept {
+    swap(other);
+    return *this;
+}
+
+void Framebuffer::swap(Framebuffer& other) noexcept {
+    std::swap(pixels, other.pixels);
+    std::swap(pixelCount, other.pixelCount);
+    std::swap(imageWidth, other.imageWidth);
+    std::swap(imageHeight, other.imageHeight);
+    std::swap(pixelLayout, other.pixelLayout);
+    std::swap(pixelFormat, other.pixelFormat);
+    std::swap(tileExtent, other.tileExtent);
+    std::swap(rowStride, other.rowStride);
+    std::swap(tileStride, other.tileStride);
+}
+
+void Framebuffer::fill(const Color& color) {
+    // Encode once, then repeat the pixel's bytes
+    alignas(Color) unsigned char pixel[sizeof(Color) > 8 ? sizeof(Color) : 8];
+    encode(pixelFormat, color, pixel);
+    size_t size = pixelSize(pixelFormat);
+    for (size_t i = 0; i < pixelCount; ++i) {
+        std::memcpy(pixels + i * size, pixel, size);
+    }
+}
+
+void Framebuffer::copyRow(int y, Color* out) const {
+    for (int x = 0; x < imageWidth; x += runLength(x)) {
+        int count = runLength(x);
+        if (pixelFormat == Format::Float) {
+            std::copy_n(&at(x, y), count, out + x);
+            continue;
+        }
+        for (int i = 0; i < count; ++i) {
+            out[x + i] = get(x + i, y);
+        }
+    }
+}
+
+void Framebuffer::quantizeRow(int y, unsigned char* rgb) const {
+    std::vector<float> channels;
+    for (int x = 0; x < imageWidth; x += runLength(x)) {
+        int count = runLength(x);
+        const unsigned char* source = address(x, y);
+        unsigned char* target = rgb + 3 * x;
+        if (pixelFormat == Format::Rgba8) {
+            // Already the output bytes
+            for (int i = 0; i < count; ++i) {
+                std::memcpy(target + 3 * i, source + 4 * i, 3);
+            }
+        } else if (pixelFormat == Format::Half) {
+            channels.resize(3 * count);
+            expandHalves(reinterpret_cast<const uint16_t*>(source), channels.size(), channels.data());
+            quantizeChannels(channels.data(), channels.size(), target);
+        } else if (sizeof(Color) == 3 * sizeof(float)) {
+            // Packed channels convert as one array
+            quantizeChannels(&at(x, y).r, 3 * count, target);
+        } else {
+            for (int i = 0; i < count; ++i) {
+                at(x + i, y).getAsIntegers(target[3 * i], target[3 * i + 1], target[3 * i + 2]);
+            }
+        }
+    }
+}
+
+Framebuffer::View Framebuffer::tile(int tileX, int tileY) {
+    int x0 = tileX * tileExtent;
+    int y0 = tileY * tileExtent;
+    int width = std::min(tileExtent, imageWidth - x0);
+    int height = std::min(tileExtent, imageHeight - y0);
+    size_t stride = pixelLayout == Layout::RowMajor ? rowStride : tileExtent;
+    return View(address(x0, y0), x0, y0, width, height, stride, pixelFormat);
+}
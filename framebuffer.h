@@ -0,0 +1,164 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "base.h"
+#include "pixels.h"
+
+// Pixels of one rendered frame in a single 64-byte-aligned allocation.
+//
+// RowMajor stores rows one after another, each padded to a whole number of cache lines,
+// so a row can be handed out as a plain array. TileMajor stores each tileSize x tileSize
+// block contiguously (edge tiles padded to full size, every tile padded to whole cache
+// lines), so threads that each write their own tiles never touch the same line.
+//
+// Float keeps each Color as rendered, which passes that add into pixels need. Half and
+// Rgba8 convert every pixel as it is set, so a frame in flight never holds floats:
+// Half keeps three half-precision channels, Rgba8 the bytes writeColorImageToPPM writes
+// and an opaque alpha.
+class Framebuffer {
+public:
+    enum class Layout {
+        RowMajor,
+        TileMajor
+    };
+    enum class Format {
+        Float,
+        Half,
+        Rgba8
+    };
+    static const size_t kAlignment = 64;
+
+    // Bytes one pixel takes in a format
+    static size_t pixelSize(Format format) {
+        switch (format) {
+        case Format::Half:
+            return 3 * sizeof(uint16_t);
+        case Format::Rgba8:
+            return 4;
+        default:
+            return sizeof(Color);
+        }
+    }
+
+    // A rectangle of pixels addressed relative to its top-left corner
+    class View {
+    public:
+        View(unsigned char* bytes, int x0, int y0, int width, int height, size_t stride, Format format)
+            : x0(x0), y0(y0), width(width), height(height), bytes(bytes), stride(stride), format(format) {}
+
+        Color get(int x, int y) const { return decode(format, address(x, y)); }
+        void set(int x, int y, const Color& color) const { encode(format, color, address(x, y)); }
+        // Image coordinates of the view's top-left pixel, and its size
+        int x0, y0;
+        int width, height;
+
+    private:
+        unsigned char* bytes;
+        size_t stride;  // Pixels from one row to the next
+        Format format;
+
+        unsigned char* address(int x, int y) const { return bytes + (y * stride + x) * pixelSize(format); }
+    };
+
+    Framebuffer() {}
+    Framebuffer(int width, int height, Layout layout = Layout::RowMajor, int tileSize = 8,
+                Format format = Format::Float);
+    ~Framebuffer();
+    Framebuffer(const Framebuffer& other);
+    Framebuffer(Framebuffer&& other) noexcept;
+    Framebuffer& operator=(Framebuffer other) noexcept;
+    void swap(Framebuffer& other) noexcept;
+
+    int width() const { return imageWidth; }
+    int height() const { return imageHeight; }
+    Layout layout() const { return pixelLayout; }
+    Format format() const { return pixelFormat; }
+    int tileSize() const { return tileExtent; }
+    bool empty() const { return pixels == nullptr; }
+    // Bytes allocated, padding included
+    size_t memoryUsage() const { return pixelCount * pixelSize(pixelFormat); }
+
+    // Pixel (x, y) in any format, converted on the way in and out
+    Color get(int x, int y) const { return decode(pixelFormat, address(x, y)); }
+    void set(int x, int y, const Color& color) { encode(pixelFormat, color, address(x, y)); }
+    void fill(const Color& color);
+    // The stored Color of pixel (x, y); Float only
+    Color& at(int x, int y) { return *reinterpret_cast<Color*>(address(x, y)); }
+    const Color& at(int x, int y) const { return *reinterpret_cast<const Color*>(address(x, y)); }
+
+    // Row y as a contiguous array; RowMajor and Float only
+    Color* row(int y) { return &at(0, y); }
+    const Color* row(int y) const { return &at(0, y); }
+    // Copies row y into out as colors, whatever the layout and format
+    void copyRow(int y, Color* out) const;
+    // Row y as the 8-bit RGB triples writeColorImageToPPM writes
+    void quantizeRow(int y, unsigned char* rgb) const;
+
+    // Tiles of tileSize x tileSize pixels, the last row and column clipped to the image
+    int tilesX() const { return (imageWidth + tileExtent - 1) / tileExtent; }
+    int tilesY() const { return (imageHeight + tileExtent - 1) / tileExtent; }
+    View tile(int tileX, int tileY);
+
+private:
+    unsigned char* pixels = nullptr;
+    size_t pixelCount = 0;  // Allocated, padding included
+    int imageWidth = 0, imageHeight = 0;
+    Layout pixelLayout = Layout::RowMajor;
+    Format pixelFormat = Format::Float;
+    int tileExtent = 8;
+    size_t rowStride = 0;   // RowMajor: pixels from one row to the next
+    size_t tileStride = 0;  // TileMajor: pixels from one tile to the next
+
+    size_t offset(int x, int y) const {
+        if (pixelLayout == Layout::RowMajor) {
+            return y * rowStride + x;
+        }
+        size_t tileIndex = static_cast<size_t>(y / tileExtent) * tilesX() + x / tileExtent;
+        return tileIndex * tileStride + (y % tileExtent) * tileExtent + x % tileExtent;
+    }
+    unsigned char* address(int x, int y) const { return pixels + offset(x, y) * pixelSize(pixelFormat); }
+    // Pixels of row y from column x on that lie one after another in memory
+    int runLength(int x) const {
+        if (pixelLayout == Layout::RowMajor) {
+            return imageWidth - x;
+        }
+        return std::min(tileExtent - x % tileExtent, imageWidth - x);
+    }
+
+    static void encode(Format format, const Color& color, unsigned char* bytes) {
+        switch (format) {
+        case Format::Half: {
+            uint16_t halves[3] = {floatToHalf(color.r), floatToHalf(color.g), floatToHalf(color.b)};
+            std::memcpy(bytes, halves, sizeof(halves));
+            break;
+        }
+        case Format::Rgba8:
+            color.getAsIntegers(bytes[0], bytes[1], bytes[2]);
+            bytes[3] = 255;
+            break;
+        default:
+            *reinterpret_cast<Color*>(bytes) = color;
+            break;
+        }
+    }
+    static Color decode(Format format, const unsigned char* bytes) {
+        switch (format) {
+        case Format::Half: {
+            uint16_t halves[3];
+            std::memcpy(halves, bytes, sizeof(halves));
+            return Color(halfToFloat(halves[0]), halfToFloat(halves[1]), halfToFloat(halves[2]));
+        }
+        case Format::Rgba8:
+            return Color(bytes[0] / 255.0f, bytes[1] / 255.0f, bytes[2] / 255.0f);
+        default: {
+            const Color& color = *reinterpret_cast<const Color*>(bytes);
+            return Color(color.r, color.g, color.b);
+        }
+        }
+    }
+};
+
+#endif // FRAMEBUFFER_H
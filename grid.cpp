@@ -0,0 +1,249 @@
+#include "grid.h"
+#include "intersect.h"
+
+namespace {
+// Cell density of the grid and the limits on its resolution
+const float kCellsPerPrimitive = 2.0f;
+const int kMaxResolution = 512;
+// A cell with more primitives than this gets a nested grid when levels remain
+const int kSubgridThreshold = 16;
+
+int clampCell(float value, int resolution) {
+    int cell = static_cast<int>(value);
+    return std::max(0, std::min(resolution - 1, cell));
+}
+}
+
+void Grid::build(const std::vector<Shape*>& input) {
+    shapes = input;
+    std::vector<AABB> primBounds(shapes.size());
+    AABB region;
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        primBounds[i] = shapes[i]->getBounds();
+        region.expand(primBounds[i]);
+    }
+    buildOver(shapes, primBounds, region);
+}
+
+float Grid::refit() {
+    std::vector<Shape*> input = shapes;
+    build(input);
+    return 1.0f;
+}
+
+void Grid::buildOver(const std::vector<Shape*>& primitives, const std::vector<AABB>& primBounds, const AABB& region) {
+    cellStart.clear();
+    cellPrims.clear();
+    cellChild.clear();
+    subgrids.clear();
+    resolution[0] = resolution[1] = resolution[2] = 0;
+    if (primitives.empty() || region.isEmpty()) {
+        return;
+    }
+
+    // Pad the region slightly so flat scenes still get a non-zero cell size and
+    // primitives on the boundary fall inside
+    bounds = region;
+    Vector3 extent = bounds.extent();
+    float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+    float pad = std::max(maxExtent * 1e-4f, 1e-6f);
+    bounds.min = bounds.min - Vector3(pad, pad, pad);
+    bounds.max = bounds.max + Vector3(pad, pad, pad);
+    extent = bounds.extent();
+
+    // Choose cubic-ish cells so the grid holds about kCellsPerPrimitive cells per primitive
+    float volume = extent.x * extent.y * extent.z;
+    float targetCells = kCellsPerPrimitive * primitives.size();
+    float cellEdge = cbrt(volume / targetCells);
+    for (int axis = 0; axis < 3; ++axis) {
+        int cells = static_cast<int>(ceil(extent[axis] / cellEdge));
+        resolution[axis] = std::max(1, std::min(kMaxResolution, cells));
+    }
+    cellSize = Vector3(extent.x / resolution[0], extent.y / resolution[1], extent.z / resolution[2]);
+    invCellSize = Vector3(1.0f / cellSize.x, 1.0f / cellSize.y, 1.0f / cellSize.z);
+
+    // Two passes over the primitive boxes: count per cell, then scatter. Boxes are widened
+    // by a fraction of a cell so rounding cannot drop a primitive from a cell it touches.
+    size_t cellCount = static_cast<size_t>(resolution[0]) * resolution[1] * resolution[2];
+    const float slack = 1e-3f;
+    std::vector<int> range(primitives.size() * 6);
+    for (size_t i = 0; i < primitives.size(); ++i) {
+        for (int axis = 0; axis < 3; ++axis) {
+            range[i * 6 + axis] = clampCell((primBounds[i].min[axis] - bounds.min[axis]) * invCellSize[axis] - slack, resolution[axis]);
+            range[i * 6 + 3 + axis] = clampCell((primBounds[i].max[axis] - bounds.min[axis]) * invCellSize[axis] + slack, resolution[axis]);
+        }
+    }
+    cellStart.assign(cellCount + 1, 0);
+    for (size_t i = 0; i < primitives.size(); ++i) {
+        const int* r = &range[i * 6];
+        for (int z = r[2]; z <= r[5]; ++z)
+            for (int y = r[1]; y <= r[4]; ++y)
+                for (int x = r[0]; x <= r[3]; ++x)
+                    ++cellStart[cellIndex(x, y, z) + 1];
+    }
+    for (size_t c = 0; c < cellCount; ++c) {
+        cellStart[c + 1] += cellStart[c];
+    }
+    cellPrims.resize(cellStart[cellCount]);
+    std::vector<uint32_t> fill(cellStart.begin(), cellStart.end() - 1);
+    for (size_t i = 0; i < primitives.size(); ++i) {
+        const int* r = &range[i * 6];
+        for (int z = r[2]; z <= r[5]; ++z)
+            for (int y = r[1]; y <= r[4]; ++y)
+                for (int x = r[0]; x <= r[3]; ++x)
+                    cellPrims[fill[cellIndex(x, y, z)]++] = primitives[i];
+    }
+
+    if (levels <= 1) {
+        return;
+    }
+
+    // Hierarchical mode: give crowded cells a nested grid over their own primitives
+    cellChild.assign(cellCount, -1);
+    for (int z = 0; z < resolution[2]; ++z) {
+        for (int y = 0; y < resolution[1]; ++y) {
+            for (int x = 0; x < resolution[0]; ++x) {
+                int c = cellIndex(x, y, z);
+                uint32_t count = cellStart[c + 1] - cellStart[c];
+                if (count <= static_cast<uint32_t>(kSubgridThreshold)) {
+                    continue;
+                }
+                AABB cell(bounds.min + Vector3(x * cellSize.x, y * cellSize.y, z * cellSize.z),
+                          bounds.min + Vector3((x + 1) * cellSize.x, (y + 1) * cellSize.y, (z + 1) * cellSize.z));
+                std::vector<Shape*> subPrims(cellPrims.begin() + cellStart[c], cellPrims.begin() + cellStart[c + 1]);
+                std::vector<AABB> subBounds(subPrims.size());
+                AABB subRegion;
+                for (size_t i = 0; i < subPrims.size(); ++i) {
+                    subBounds[i] = subPrims[i]->getBounds();
+                    subRegion.expand(subBounds[i]);
+                }
+                // Only the part of the primitives inside this cell matters
+                subRegion.min = Vector3::max(subRegion.min, cell.min);
+                subRegion.max = Vector3::min(subRegion.max, cell.max);
+                std::unique_ptr<Grid> subgrid(new Grid(levels - 1));
+                subgrid->buildOver(subPrims, subBounds, subRegion);
+                cellChild[c] = static_cast<int>(subgrids.size());
+                subgrids.push_back(std::move(subgrid));
+            }
+        }
+    }
+}
+
+size_t Grid::memoryUsage() const {
+    size_t bytes = shapes.size() * sizeof(Shape*) + cellStart.size() * sizeof(uint32_t)
+        + cellPrims.size() * sizeof(Shape*) + cellChild.size() * sizeof(int);
+    for (const auto& subgrid : subgrids) {
+        bytes += sizeof(Grid) + subgrid->memoryUsage();
+    }
+    return bytes;
+}
+
+bool Grid::intersect(const Ray& ray, Hit& hit) const {
+    Vector3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    return traverse(ray, invDir, 0.0f, hit.distance, hit);
+}
+
+template <typename Visit>
+bool Grid::walk(const Ray& ray, const Vector3& invDir, float tMin, float tMax, Visit visit) const {
+    if (cellStart.empty()) {
+        return false;
+    }
+
+    // Clip the ray segment [tMin, tMax] to the grid box
+    float tEnter = tMin;
+    float tExit = tMax;
+    for (int axis = 0; axis < 3; ++axis) {
+        float t0 = (bounds.min[axis] - ray.origin[axis]) * invDir[axis];
+        float t1 = (bounds.max[axis] - ray.origin[axis]) * invDir[axis];
+        tEnter = std::max(tEnter, std::min(t0, t1));
+        tExit = std::min(tExit, std::max(t0, t1));
+    }
+    if (tEnter > tExit) {
+        return false;
+    }
+
+    // 3D-DDA setup (Amanatides & Woo): starting cell, step direction, the distance to the
+    // next cell boundary on each axis and the distance between boundaries
+    Vector3 start = ray.at(tEnter);
+    int cell[3], step[3], end[3];
+    float tNext[3], tDelta[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        cell[axis] = clampCell((start[axis] - bounds.min[axis]) * invCellSize[axis], resolution[axis]);
+        float d = ray.direction[axis];
+        if (d > 0.0f) {
+            step[axis] = 1;
+            end[axis] = resolution[axis];
+            tNext[axis] = (bounds.min[axis] + (cell[axis] + 1) * cellSize[axis] - ray.origin[axis]) * invDir[axis];
+            tDelta[axis] = cellSize[axis] * invDir[axis];
+        } else if (d < 0.0f) {
+            step[axis] = -1;
+            end[axis] = -1;
+            tNext[axis] = (bounds.min[axis] + cell[axis] * cellSize[axis] - ray.origin[axis]) * invDir[axis];
+            tDelta[axis] = -cellSize[axis] * invDir[axis];
+        } else {
+            step[axis] = 0;
+            end[axis] = -1;
+            tNext[axis] = std::numeric_limits<float>::infinity();
+            tDelta[axis] = std::numeric_limits<float>::infinity();
+        }
+    }
+
+    float tCell = tEnter;
+    while (true) {
+        int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+        float tCellExit = std::min(tNext[axis], tExit);
+        if (visit(cellIndex(cell[0], cell[1], cell[2]), tCell, tCellExit)) {
+            return true;
+        }
+        if (tNext[axis] > tExit) {
+            return false;
+        }
+        cell[axis] += step[axis];
+        if (cell[axis] == end[axis]) {
+            return false;
+        }
+        tCell = tNext[axis];
+        tNext[axis] += tDelta[axis];
+    }
+}
+
+bool Grid::traverse(const Ray& ray, const Vector3& invDir, float tMin, float tMax, Hit& hit) const {
+    bool found = false;
+    walk(ray, invDir, tMin, tMax, [&](int c, float tCell, float tCellExit) {
+        if (!cellChild.empty() && cellChild[c] >= 0) {
+            if (subgrids[cellChild[c]]->traverse(ray, invDir, tCell, std::min(tCellExit, hit.distance), hit)) {
+                found = true;
+            }
+        } else {
+            for (uint32_t i = cellStart[c]; i < cellStart[c + 1]; ++i) {
+                if (intersectPrimitive(ray, cellPrims[i], hit)) {
+                    found = true;
+                }
+            }
+        }
+        // A hit inside this cell cannot be beaten by anything in the cells further on
+        return hit.distance <= tCellExit;
+    });
+    return found;
+}
+
+bool Grid::occluded(const Ray& ray, float tMax, Shape*& blocker) const {
+    Vector3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    return occludedRange(ray, invDir, 0.0f, tMax, blocker);
+}
+
+bool Grid::occludedRange(const Ray& ray, const Vector3& invDir, float tMin, float tMax, Shape*& blocker) const {
+    // Same cell walk, but the first blocking primitive ends it
+    return walk(ray, invDir, tMin, tMax, [&](int c, float tCell, float tCellExit) {
+        if (!cellChild.empty() && cellChild[c] >= 0) {
+            return subgrids[cellChild[c]]->occludedRange(ray, invDir, tCell, tCellExit, blocker);
+        }
+        for (uint32_t i = cellStart[c]; i < cellStart[c + 1]; ++i) {
+            if (occludedPrimitive(ray, cellPrims[i], tMax)) {
+                blocker = cellPrims[i];
+                return true;
+            }
+        }
+        return false;
+    });
+}
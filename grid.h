@@ -0,0 +1,52 @@
+#ifndef GRID_H
+#define GRID_H
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "base.h"
+#include "accel.h"
+
+// Uniform grid traversed with a 3D-DDA, built in linear time. Suits scenes of many
+// similar-sized primitives spread evenly (particles, bouncing balls) better than a tree.
+// The resolution follows the primitive density: about kCellsPerPrimitive cells per
+// primitive, split between the axes in proportion to the scene extent.
+// With levels > 1 the grid is hierarchical: crowded cells get their own nested grid.
+class Grid : public Accelerator {
+public:
+    explicit Grid(int levels = 1) : levels(levels) {}
+
+    void build(const std::vector<Shape*>& shapes) override;
+    // A grid has no topology worth keeping, so a refit is simply a (linear-time) rebuild
+    float refit() override;
+    bool intersect(const Ray& ray, Hit& hit) const override;
+    bool occluded(const Ray& ray, float tMax, Shape*& blocker) const override;
+    size_t memoryUsage() const override;
+    const char* name() const override { return levels > 1 ? "hgrid" : "grid"; }
+
+private:
+    int levels;
+    std::vector<Shape*> shapes;
+    AABB bounds;
+    int resolution[3] = {0, 0, 0};
+    Vector3 cellSize;
+    Vector3 invCellSize;
+    // Cell c holds primitives cellPrims[cellStart[c] .. cellStart[c + 1]), or descends
+    // into subgrids[cellChild[c]] when cellChild is non-empty and cellChild[c] >= 0
+    std::vector<uint32_t> cellStart;
+    std::vector<Shape*> cellPrims;
+    std::vector<int> cellChild;
+    std::vector<std::unique_ptr<Grid>> subgrids;
+
+    void buildOver(const std::vector<Shape*>& primitives, const std::vector<AABB>& primBounds, const AABB& region);
+    // Walks the cells pierced by the ray within [tMin, tMax] front to back, calling
+    // visit(cell, tCellEnter, tCellExit) until it returns true
+    template <typename Visit>
+    bool walk(const Ray& ray, const Vector3& invDir, float tMin, float tMax, Visit visit) const;
+    bool traverse(const Ray& ray, const Vector3& invDir, float tMin, float tMax, Hit& hit) const;
+    bool occludedRange(const Ray& ray, const Vector3& invDir, float tMin, float tMax, Shape*& blocker) const;
+    int cellIndex(int x, int y, int z) const {
+        return (z * resolution[1] + y) * resolution[0] + x;
+    }
+};
+
+#endif // GRID_H
@@ -2,21 +2,13 @@
 #include <vector>
 #include <string>
 #include "base.h"
-
-
-class Ray {
-public:
-    Vector3 origin;
-    Vector3 direction;
-
-    Ray(const Vector3& origin, const Vector3& direction)
-        : origin(origin), direction(direction) {}
-    
-    // Function to compute a point along the ray
-    Vector3 at(float t) const {
-        return origin + direction * t;
-    }
-};
+#include <atomic>
+#include <memory>
+#include "accel.h"
+#include "instance.h"
+#include "lighttree.h"
+#include "raygen.h"
+#include "framebuffer.h"
 
 
 class Camera {
@@ -38,6 +30,7 @@ public:
     Color backgroundColor;
     std::vector<Shape*> shapes;
     std::vector<LightSource*> lights; // Container for light sources
+    std::vector<Mesh*> meshes;        // Meshes shared by instance shapes
 
     ~Scene() {
         // Destructor to clean up allocated Shapes
@@ -48,12 +41,30 @@ public:
         for (auto* light : lights) {
             delete light;
         }
+        for (auto* mesh : meshes) {
+            delete mesh;
+        }
     }
 
     // Add a method to add lights to the scene
     void addLight(LightSource* light) {
         lights.push_back(light);
     }
+
+    void clearLights() {
+        for (auto* light : lights) {
+            delete light;
+        }
+        lights.clear();
+    }
+
+    // Replaces the mesh set; call once no instance refers to the old meshes any more
+    void setMeshes(const std::vector<Mesh*>& newMeshes) {
+        for (auto* mesh : meshes) {
+            delete mesh;
+        }
+        meshes = newMeshes;
+    }
 };
 
 
@@ -62,23 +73,79 @@ public:
     std::string renderMode;
     Camera camera;
     Scene scene;
+    // Acceleration structure for ray queries, selected by the scene's "accelerator" key
+    std::string acceleratorType = "bvh";
+    std::unique_ptr<Accelerator> accelerator;
+    // Reloading a scene whose shapes only moved refits the BVH instead of rebuilding it,
+    // as long as the refitted SAH cost stays within this factor of the freshly built one
+    float refitThreshold = 1.5f;
+    // Extra primitive references the "sbvh" accelerator may create by splitting, as a
+    // fraction of the primitive count; set by the scene's "spatialsplitbudget" key
+    float spatialSplitBudget = 0.3f;
+    // Wall-clock time of the last accelerator build and of the last render() call
+    double buildMilliseconds = 0.0;
+    double renderMilliseconds = 0.0;
+    // Keep built acceleration structures of large scenes in <scene>.json.accel and map
+    // them on later loads of the same geometry
+    bool useAcceleratorCache = true;
+    // Render "phong" scenes with renderPhongWavefront; set by the scene's "wavefront" key
+    bool wavefront = false;
+    // Store rendered frames tile by tile (tiles of kPacketSize pixels) instead of row by
+    // row; set by the scene's "tilemajor" key
+    bool tileMajor = false;
+    // How rendered frames store pixels; set by the scene's "pixelformat" key ("float",
+    // "half" or "rgba8")
+    Framebuffer::Format pixelFormat = Framebuffer::Format::Float;
+    // Hierarchy over the scene's lights. With lightError above 0 each point is lit by a
+    // cut through it whose clusters each carry an error bound below lightError times the
+    // point's color, instead of by every light; set by the scene's "lighterror" key
+    LightTree lightTree;
+    float lightError = 0.0f;
     void loadFromJSON(const std::string& filename);
 
     // render part
-    std::vector<std::vector<Color>> render();
-    std::vector<std::vector<Color>> renderBinary();
-    std::vector<std::vector<Color>> renderPhong();
-    void writeColorImageToPPM(const std::vector<std::vector<Color>>& image, const std::string& filename);
-private:
+    Framebuffer render();
+    Framebuffer renderBinary();
+    Framebuffer renderPhong();
+    // Same image as renderPhong, computed in stages over bands of the image: all primary
+    // rays, then all local shading, then one sorted stream of shadow rays per light
+    Framebuffer renderPhongWavefront();
+    void writeColorImageToPPM(const Framebuffer& image, const std::string& filename);
+    // Primary camera ray for pixel (x, y), computed from scratch; render() uses
+    // rayGenerator, which returns the same rays
     Ray computeRay(int x, int y);
+    // Primary rays of the current frame, set up at the start of render()
+    CameraRayGenerator rayGenerator;
+    // Shadow-ray last-occluder cache counters, summed over threads; renderPhongWavefront
+    // does not use the cache
+    std::atomic<unsigned long long> shadowCacheLookups{0};
+    std::atomic<unsigned long long> shadowCacheHits{0};
+private:
+    bool acceleratorBuilt = false;
+    unsigned long long sceneGeneration = 0;
+
+    bool updateShapes(const std::vector<Shape*>& shapes);
 
-    bool intersectBinary(const Ray& ray, Shape* shape);
-    bool intersect(const Ray& ray, Shape* shape, float& distance);
-    bool isInShadow(const Vector3& point, const std::vector<Shape*>& shapes, const std::vector<LightSource*>& lights);
+    bool intersectScene(const Ray& ray, Hit& hit);
+    void intersectScenePacket(const Ray* rays, int count, Hit* hits);
+    bool occludedScene(const Ray& ray, float tMax, Shape*& blocker);
+    void flushShadowCacheStats();
+    // Empty frame of the camera's size in the layout and format tileMajor and pixelFormat ask for
+    Framebuffer createFramebuffer() const;
+    // Lights to shade a point with: the scene's, or a cut through the light tree.
+    // lightIds receives the scene index of each returned light, or null when they are
+    // the scene's own lights in order.
+    const std::vector<LightSource*>& shadingLights(const Vector3& point, const Vector3& normal, const Material& material,
+                                                   const Vector3& viewDirection, LightCut& cut, const int*& lightIds);
+    bool isInShadow(const Vector3& point, const std::vector<LightSource*>& lights, const int* lightIds = nullptr);
     Color adjustForShadows(const Color& originalColor);
     Color calculateReflection(const Ray& incidentRay, const Vector3& intersectionPoint, const Vector3& normal, const Material& material);
     Color traceRefractedRay(const Ray& refractedRay);
     Color calculateRefraction(const Ray& ray, const Vector3& intersectionPoint, const Vector3& normal, const Material& material);
     Vector3 refract(const Vector3& incident, const Vector3& normal, float eta);
     float clamp(float min, float max, float value) ;
-};
\ No newline at end of file
+};
+
+// Blinn-Phong shading of a surface point by every light in lights, without shadows
+Color calculateLocalIllumination(const Vector3& intersectionPoint, const Vector3& normal, const Material& material,
+                                 const Vector3& viewDirection, const std::vector<LightSource*>& lights);
@@ -0,0 +1,67 @@
+#include "instance.h"
+
+AABB Instance::getBounds() const {
+    AABB box;
+    if (mesh == nullptr || mesh->bvh.empty()) {
+        return box;
+    }
+    const AABB& local = mesh->bvh.bounds();
+    for (int corner = 0; corner < 8; ++corner) {
+        Vector3 p(corner & 1 ? local.max.x : local.min.x,
+                  corner & 2 ? local.max.y : local.min.y,
+                  corner & 4 ? local.max.z : local.min.z);
+        box.expand(objectToWorld * p);
+    }
+    return box;
+}
+
+Vector3 Instance::getNormal(const Vector3& point) const {
+    Vector3 localPoint = worldToObject * point;
+    const Shape* closest = nullptr;
+    float closestDistance = std::numeric_limits<float>::max();
+    for (const Shape* shape : mesh->triangles) {
+        const Triangle* triangle = static_cast<const Triangle*>(shape);
+        float distance = std::abs(Vector3::dot(localPoint - triangle->v0, triangle->getNormal(localPoint)));
+        if (distance < closestDistance) {
+            closestDistance = distance;
+            closest = shape;
+        }
+    }
+    if (closest == nullptr) {
+        return Vector3(0, 0, 0);
+    }
+    return Vector3::normalize(normalToWorld.transformDirection(closest->getNormal(localPoint)));
+}
+
+bool Instance::intersect(const Ray& ray, Hit& hit) const {
+    // The direction is transformed without normalizing, so distances along the
+    // object-space ray match distances along the world-space ray
+    Ray localRay(worldToObject * ray.origin, worldToObject.transformDirection(ray.direction));
+    Hit localHit;
+    localHit.distance = hit.distance;
+    if (!mesh->bvh.intersect(localRay, localHit)) {
+        return false;
+    }
+    hit.distance = localHit.distance;
+    hit.shape = localHit.shape;
+    hit.instance = this;
+    return true;
+}
+
+bool Instance::occluded(const Ray& ray, float tMax) const {
+    Ray localRay(worldToObject * ray.origin, worldToObject.transformDirection(ray.direction));
+    Shape* blocker;
+    return mesh->bvh.occluded(localRay, tMax, blocker);
+}
+
+Vector3 Hit::normal(const Vector3& point) const {
+    if (instance == nullptr) {
+        return shape->getNormal(point);
+    }
+    Vector3 localNormal = shape->getNormal(instance->worldToObject * point);
+    return Vector3::normalize(instance->normalToWorld.transformDirection(localNormal));
+}
+
+const Material& Hit::material() const {
+    return instance != nullptr ? instance->material : shape->material;
+}
@@ -0,0 +1,53 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+#include <string>
+#include <vector>
+#include "base.h"
+#include "bvh.h"
+
+// Triangle mesh shared by any number of instances. The bottom-level BVH is built once
+// in object space; instances only add a transform on top of it.
+class Mesh {
+public:
+    std::string name;
+    std::vector<Shape*> triangles;
+    BVH bvh;
+
+    ~Mesh() {
+        for (auto* triangle : triangles) {
+            delete triangle;
+        }
+    }
+
+    void build() {
+        bvh.build(triangles);
+    }
+};
+
+// Placement of a shared mesh in the scene. Acts as a single primitive in the top-level
+// BVH; rays are moved into object space and traced through the mesh's own hierarchy.
+class Instance : public Shape {
+public:
+    const Mesh* mesh = nullptr;
+    Matrix4x4 objectToWorld = Matrix4x4::identity();
+    Matrix4x4 worldToObject = Matrix4x4::identity();
+    Matrix4x4 normalToWorld = Matrix4x4::identity();
+
+    void setTransform(const Matrix4x4& transform) {
+        objectToWorld = transform;
+        worldToObject = transform.inverse();
+        normalToWorld = worldToObject.transpose();
+    }
+
+    Instance() : Shape(ShapeType::Instance) {}
+    // Renderer code resolves instance normals through Hit::normal, which knows the
+    // triangle that was hit; this fallback searches the mesh for the closest plane
+    Vector3 getNormal(const Vector3& point) const override;
+    AABB getBounds() const override;
+
+    // Updates hit when the ray meets the mesh closer than hit.distance
+    bool intersect(const Ray& ray, Hit& hit) const;
+    bool occluded(const Ray& ray, float tMax) const;
+};
+
+#endif // INSTANCE_H
@@ -0,0 +1,463 @@
+#include "intersect.h"
+#include "instance.h"
+#include "simd.h"
+#include "cpu.h"
+#include <cmath>
+
+bool intersectSphere(const Ray& ray, const Vector3& center, float radiusSquared, float& distance) {
+    Vector3 oc = ray.origin - center;
+    float a = Vector3::dot(ray.direction, ray.direction);
+    float b = 2.0f * Vector3::dot(oc, ray.direction);
+    float c = Vector3::dot(oc, oc) - radiusSquared;
+    float discriminant = b * b - 4 * a * c;
+    if (discriminant > 0) {
+        float sqrtDiscriminant = sqrt(discriminant);
+        float t1 = (-b - sqrtDiscriminant) / (2.0f * a);
+        float t2 = (-b + sqrtDiscriminant) / (2.0f * a);
+
+        // Ensure t1 is the smaller (closer) t value
+        if (t1 > t2) {
+            std::swap(t1, t2);
+        }
+
+        // If t1 is positive, we use it
+        if (t1 > 0) {
+            distance = t1;
+            return true;
+        }
+        
+        // If t1 is negative but t2 is positive, we use t2
+        if (t2 > 0) {
+            distance = t2;
+            return true;
+        }
+    }
+    return false;
+}
+
+namespace {
+// A ray in a cylinder's local space (see CylinderFrame)
+struct LocalRay {
+    float ox, oy, oz;
+    float dx, dy, dz;
+
+    LocalRay(const Ray& ray, const Vector3& center, const CylinderFrame& frame) {
+        Vector3 offset = ray.origin - center;
+        ox = Vector3::dot(offset, frame.tangent);
+        oy = Vector3::dot(offset, frame.bitangent);
+        oz = Vector3::dot(offset, frame.unitAxis);
+        dx = Vector3::dot(ray.direction, frame.tangent);
+        dy = Vector3::dot(ray.direction, frame.bitangent);
+        dz = Vector3::dot(ray.direction, frame.unitAxis);
+    }
+};
+
+// Roots of the side's 2D quadratic, nearest first; false if the ray misses the infinite
+// cylinder or runs parallel to it. Uses the cancellation-free form of the roots.
+bool sideRoots(const LocalRay& local, float radiusSquared, float& t1, float& t2) {
+    float a = local.dx * local.dx + local.dy * local.dy;
+    float halfB = local.ox * local.dx + local.oy * local.dy;
+    float c = local.ox * local.ox + local.oy * local.oy - radiusSquared;
+    float discriminant = halfB * halfB - a * c;
+    if (a == 0.0f || discriminant < 0.0f) {
+        return false;
+    }
+    float q = -(halfB + std::copysign(std::sqrt(discriminant), halfB));
+    t1 = q / a;
+    t2 = c / q;
+    if (t1 > t2) {
+        std::swap(t1, t2);
+    }
+    return true;
+}
+
+// Whether the point at t, on one of the cap planes, lies within the cap's radius
+bool onCap(const LocalRay& local, float t, float radiusSquared) {
+    float x = local.ox + local.dx * t;
+    float y = local.oy + local.dy * t;
+    return x * x + y * y <= radiusSquared;
+}
+}
+
+bool intersectCylinder(const Ray& ray, const Vector3& center, const CylinderFrame& frame, float& distance) {
+    LocalRay local(ray, center, frame);
+    float nearest = std::numeric_limits<float>::infinity();
+
+    // Side: the nearest root in front of the origin between the cap planes
+    float t1, t2;
+    if (sideRoots(local, frame.radiusSquared, t1, t2)) {
+        if (t1 > 0 && std::abs(local.oz + local.dz * t1) <= frame.halfHeight) {
+            nearest = t1;
+        } else if (t2 > 0 && std::abs(local.oz + local.dz * t2) <= frame.halfHeight) {
+            nearest = t2;
+        }
+    }
+
+    // Caps: slab entry and exit along z, kept when inside the radius
+    if (local.dz != 0.0f) {
+        float inverse = 1.0f / local.dz;
+        float tTop = (frame.halfHeight - local.oz) * inverse;
+        float tBottom = (-frame.halfHeight - local.oz) * inverse;
+        if (tTop > 0 && tTop < nearest && onCap(local, tTop, frame.radiusSquared)) {
+            nearest = tTop;
+        }
+        if (tBottom > 0 && tBottom < nearest && onCap(local, tBottom, frame.radiusSquared)) {
+            nearest = tBottom;
+        }
+    }
+
+    if (nearest < std::numeric_limits<float>::infinity()) {
+        distance = nearest;
+        return true;
+    }
+    return false;
+}
+
+bool intersectTriangle(const Ray& ray, const Vector3& v0, const Vector3& edge1, const Vector3& edge2, float& distance) {
+    Vector3 pvec = Vector3::cross(ray.direction, edge2);
+    float det = Vector3::dot(edge1, pvec);
+    if (fabs(det) < 1e-8) {
+        return false;  // Ray is parallel to the triangle
+    }
+    float invDet = 1.0f / det;
+    Vector3 tvec = ray.origin - v0;
+    float u = Vector3::dot(tvec, pvec) * invDet;
+    if (u < 0.0f || u > 1.0f) {
+        return false;
+    }
+    Vector3 qvec = Vector3::cross(tvec, edge1);
+    float v = Vector3::dot(ray.direction, qvec) * invDet;
+    if (v < 0.0f || u + v > 1.0f) {
+        return false;
+    }
+    // Compute the distance to the intersection point
+    float minDistance = Vector3::dot(edge2, qvec) * invDet;
+    if (minDistance > 1e-8) { // Check for a positive distance to avoid intersections behind the ray origin
+        distance = minDistance;
+        return true;  // Ray intersects the triangle
+    }
+    return false;
+}
+
+// Any-hit variants for shadow rays: report whether some surface lies in (0, tMax)
+// without picking the nearest root
+
+bool occludeSphere(const Ray& ray, const Vector3& center, float radiusSquared, float tMax) {
+    Vector3 oc = ray.origin - center;
+    float a = Vector3::dot(ray.direction, ray.direction);
+    float b = 2.0f * Vector3::dot(oc, ray.direction);
+    float c = Vector3::dot(oc, oc) - radiusSquared;
+    float discriminant = b * b - 4 * a * c;
+    if (discriminant <= 0) {
+        return false;
+    }
+    float sqrtDiscriminant = sqrt(discriminant);
+    float t1 = (-b - sqrtDiscriminant) / (2.0f * a);
+    float t2 = (-b + sqrtDiscriminant) / (2.0f * a);
+    return (t1 > 0 && t1 < tMax) || (t2 > 0 && t2 < tMax);
+}
+
+bool occludeCylinder(const Ray& ray, const Vector3& center, const CylinderFrame& frame, float tMax) {
+    LocalRay local(ray, center, frame);
+    float t1, t2;
+    if (sideRoots(local, frame.radiusSquared, t1, t2)) {
+        for (float t : {t1, t2}) {
+            if (t > 0 && t < tMax && std::abs(local.oz + local.dz * t) <= frame.halfHeight) {
+                return true;
+            }
+        }
+    }
+    if (local.dz != 0.0f) {
+        float inverse = 1.0f / local.dz;
+        for (float z : {frame.halfHeight, -frame.halfHeight}) {
+            float t = (z - local.oz) * inverse;
+            if (t > 0 && t < tMax && onCap(local, t, frame.radiusSquared)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool occludeTriangle(const Ray& ray, const Vector3& v0, const Vector3& edge1, const Vector3& edge2, float tMax) {
+    float distance;
+    return intersectTriangle(ray, v0, edge1, edge2, distance) && distance < tMax;
+}
+
+namespace {
+// Variants of the block kernels, one per instruction set; intersectSphereBlock and
+// intersectTriangleBlock call the one for the level cpu.h selects
+typedef int (*SphereBlockKernel)(const Ray&, const float*, const float*, const float*, const float*, float*);
+typedef int (*TriangleBlockKernel)(const Ray&, const float*, const float*, const float*, const float*, const float*,
+                                   const float*, const float*, const float*, const float*, float*);
+
+int sphereBlockScalar(const Ray& ray, const float* centerX, const float* centerY, const float* centerZ,
+                      const float* radiusSquared, float* distances) {
+    int mask = 0;
+    for (int i = 0; i < kBlockSize; ++i) {
+        if (intersectSphere(ray, Vector3(centerX[i], centerY[i], centerZ[i]), radiusSquared[i], distances[i])) {
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+}
+
+int triangleBlockScalar(const Ray& ray, const float* v0x, const float* v0y, const float* v0z, const float* edge1x,
+                        const float* edge1y, const float* edge1z, const float* edge2x, const float* edge2y,
+                        const float* edge2z, float* distances) {
+    int mask = 0;
+    for (int i = 0; i < kBlockSize; ++i) {
+        if (intersectTriangle(ray, Vector3(v0x[i], v0y[i], v0z[i]), Vector3(edge1x[i], edge1y[i], edge1z[i]),
+                              Vector3(edge2x[i], edge2y[i], edge2z[i]), distances[i])) {
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+}
+
+#if defined(RT_SSE)
+// Two groups of 4 lanes, with the same operations as the 8-lane kernels
+inline __m128 dot4(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz) {
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+}
+
+int sphereBlockSse(const Ray& ray, const float* centerX, const float* centerY, const float* centerZ,
+                   const float* radiusSquared, float* distances) {
+    __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+    __m128 a = _mm_set1_ps(Vector3::dot(ray.direction, ray.direction));
+    __m128 fourA = _mm_mul_ps(_mm_set1_ps(4.0f), a);
+    __m128 twoA = _mm_mul_ps(_mm_set1_ps(2.0f), a);
+    __m128 zero = _mm_setzero_ps();
+    int mask = 0;
+    for (int group = 0; group < kBlockSize; group += 4) {
+        __m128 ocx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(centerX + group));
+        __m128 ocy = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(centerY + group));
+        __m128 ocz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(centerZ + group));
+        __m128 b = _mm_mul_ps(_mm_set1_ps(2.0f), dot4(ocx, ocy, ocz, dx, dy, dz));
+        __m128 c = _mm_sub_ps(dot4(ocx, ocy, ocz, ocx, ocy, ocz), _mm_loadu_ps(radiusSquared + group));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(fourA, c));
+        __m128 valid = _mm_cmpgt_ps(discriminant, zero);
+
+        __m128 sqrtDiscriminant = _mm_sqrt_ps(discriminant);
+        __m128 minusB = _mm_xor_ps(b, _mm_set1_ps(-0.0f));
+        __m128 t1 = _mm_div_ps(_mm_sub_ps(minusB, sqrtDiscriminant), twoA);
+        __m128 t2 = _mm_div_ps(_mm_add_ps(minusB, sqrtDiscriminant), twoA);
+        __m128 nearT = _mm_min_ps(t2, t1);
+        __m128 farT = _mm_max_ps(t2, t1);
+        __m128 nearInFront = _mm_cmpgt_ps(nearT, zero);
+        __m128 farInFront = _mm_cmpgt_ps(farT, zero);
+        _mm_storeu_ps(distances + group,
+                      _mm_or_ps(_mm_and_ps(nearInFront, nearT), _mm_andnot_ps(nearInFront, farT)));
+        mask |= _mm_movemask_ps(_mm_and_ps(valid, _mm_or_ps(nearInFront, farInFront))) << group;
+    }
+    return mask;
+}
+
+int triangleBlockSse(const Ray& ray, const float* v0x, const float* v0y, const float* v0z, const float* edge1x,
+                     const float* edge1y, const float* edge1z, const float* edge2x, const float* edge2y,
+                     const float* edge2z, float* distances) {
+    __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 epsilon = _mm_set1_ps(1e-8f);
+    int mask = 0;
+    for (int group = 0; group < kBlockSize; group += 4) {
+        __m128 e1x = _mm_loadu_ps(edge1x + group), e1y = _mm_loadu_ps(edge1y + group), e1z = _mm_loadu_ps(edge1z + group);
+        __m128 e2x = _mm_loadu_ps(edge2x + group), e2y = _mm_loadu_ps(edge2y + group), e2z = _mm_loadu_ps(edge2z + group);
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = dot4(e1x, e1y, e1z, px, py, pz);
+        __m128 valid = _mm_cmpnle_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), det), epsilon);
+        __m128 invDet = _mm_div_ps(one, det);
+
+        __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(v0x + group));
+        __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(v0y + group));
+        __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(v0z + group));
+        __m128 u = _mm_mul_ps(dot4(tx, ty, tz, px, py, pz), invDet);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpnlt_ps(u, zero), _mm_cmpngt_ps(u, one)));
+
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+        __m128 v = _mm_mul_ps(dot4(dx, dy, dz, qx, qy, qz), invDet);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpnlt_ps(v, zero), _mm_cmpngt_ps(_mm_add_ps(u, v), one)));
+
+        __m128 t = _mm_mul_ps(dot4(e2x, e2y, e2z, qx, qy, qz), invDet);
+        valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, epsilon));
+        _mm_storeu_ps(distances + group, t);
+        mask |= _mm_movemask_ps(valid) << group;
+    }
+    return mask;
+}
+#endif
+
+#if defined(RT_DISPATCH)
+// x * x + y * y + z * z per lane, summed in the scalar Vector3::dot order
+RT_TARGET("avx2")
+inline __m256 dot8(__m256 ax, __m256 ay, __m256 az, __m256 bx, __m256 by, __m256 bz) {
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax, bx), _mm256_mul_ps(ay, by)), _mm256_mul_ps(az, bz));
+}
+
+RT_TARGET("avx2")
+int sphereBlockAvx2(const Ray& ray, const float* centerX, const float* centerY, const float* centerZ,
+                    const float* radiusSquared, float* distances) {
+    __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+    __m256 ocx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(centerX));
+    __m256 ocy = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(centerY));
+    __m256 ocz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(centerZ));
+    __m256 a = _mm256_set1_ps(Vector3::dot(ray.direction, ray.direction));
+    __m256 b = _mm256_mul_ps(_mm256_set1_ps(2.0f), dot8(ocx, ocy, ocz, dx, dy, dz));
+    __m256 c = _mm256_sub_ps(dot8(ocx, ocy, ocz, ocx, ocy, ocz), _mm256_loadu_ps(radiusSquared));
+    __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(4.0f), a), c));
+    __m256 zero = _mm256_setzero_ps();
+    __m256 valid = _mm256_cmp_ps(discriminant, zero, _CMP_GT_OQ);
+
+    __m256 sqrtDiscriminant = _mm256_sqrt_ps(discriminant);
+    __m256 twoA = _mm256_mul_ps(_mm256_set1_ps(2.0f), a);
+    __m256 minusB = _mm256_xor_ps(b, _mm256_set1_ps(-0.0f));
+    __m256 t1 = _mm256_div_ps(_mm256_sub_ps(minusB, sqrtDiscriminant), twoA);
+    __m256 t2 = _mm256_div_ps(_mm256_add_ps(minusB, sqrtDiscriminant), twoA);
+    __m256 nearT = _mm256_min_ps(t2, t1);
+    __m256 farT = _mm256_max_ps(t2, t1);
+    // The nearer root if it is in front of the origin, else the farther one
+    __m256 nearInFront = _mm256_cmp_ps(nearT, zero, _CMP_GT_OQ);
+    __m256 farInFront = _mm256_cmp_ps(farT, zero, _CMP_GT_OQ);
+    _mm256_storeu_ps(distances, _mm256_blendv_ps(farT, nearT, nearInFront));
+    return _mm256_movemask_ps(_mm256_and_ps(valid, _mm256_or_ps(nearInFront, farInFront)));
+}
+
+RT_TARGET("avx2")
+int triangleBlockAvx2(const Ray& ray, const float* v0x, const float* v0y, const float* v0z, const float* edge1x,
+                      const float* edge1y, const float* edge1z, const float* edge2x, const float* edge2y,
+                      const float* edge2z, float* distances) {
+    __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+    __m256 e1x = _mm256_loadu_ps(edge1x), e1y = _mm256_loadu_ps(edge1y), e1z = _mm256_loadu_ps(edge1z);
+    __m256 e2x = _mm256_loadu_ps(edge2x), e2y = _mm256_loadu_ps(edge2y), e2z = _mm256_loadu_ps(edge2z);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1.0f);
+    // The scalar kernel compares against the double 1e-8; for floats, |det| < 1e-8 holds
+    // exactly when |det| <= 1e-8f, and t > 1e-8 exactly when t > 1e-8f
+    __m256 epsilon = _mm256_set1_ps(1e-8f);
+
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 det = dot8(e1x, e1y, e1z, px, py, pz);
+    __m256 absDet = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), det);
+    __m256 valid = _mm256_cmp_ps(absDet, epsilon, _CMP_NLE_UQ);
+    __m256 invDet = _mm256_div_ps(one, det);
+
+    __m256 tx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(v0x));
+    __m256 ty = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(v0y));
+    __m256 tz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(v0z));
+    __m256 u = _mm256_mul_ps(dot8(tx, ty, tz, px, py, pz), invDet);
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, zero, _CMP_NLT_UQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, one, _CMP_NGT_UQ));
+
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+    __m256 v = _mm256_mul_ps(dot8(dx, dy, dz, qx, qy, qz), invDet);
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, zero, _CMP_NLT_UQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_NGT_UQ));
+
+    __m256 t = _mm256_mul_ps(dot8(e2x, e2y, e2z, qx, qy, qz), invDet);
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, epsilon, _CMP_GT_OQ));
+    _mm256_storeu_ps(distances, t);
+    return _mm256_movemask_ps(valid);
+}
+#endif
+}
+
+int intersectSphereBlock(const Ray& ray, const float* centerX, const float* centerY, const float* centerZ,
+                         const float* radiusSquared, float* distances) {
+    static const SphereBlockKernel kernel = [] {
+        Isa isa = selectedIsa();
+#if defined(RT_DISPATCH)
+        if (isa >= Isa::AVX2) {
+            return chooseKernel<SphereBlockKernel>("sphere blocks", Isa::AVX2, sphereBlockAvx2);
+        }
+#endif
+#if defined(RT_SSE)
+        if (isa >= Isa::SSE2) {
+            return chooseKernel<SphereBlockKernel>("sphere blocks", Isa::SSE2, sphereBlockSse);
+        }
+#endif
+        return chooseKernel<SphereBlockKernel>("sphere blocks", Isa::Scalar, sphereBlockScalar);
+    }();
+    return kernel(ray, centerX, centerY, centerZ, radiusSquared, distances);
+}
+
+int intersectTriangleBlock(const Ray& ray, const float* v0x, const float* v0y, const float* v0z, const float* edge1x,
+                           const float* edge1y, const float* edge1z, const float* edge2x, const float* edge2y,
+                           const float* edge2z, float* distances) {
+    static const TriangleBlockKernel kernel = [] {
+        Isa isa = selectedIsa();
+#if defined(RT_DISPATCH)
+        if (isa >= Isa::AVX2) {
+            return chooseKernel<TriangleBlockKernel>("triangle blocks", Isa::AVX2, triangleBlockAvx2);
+        }
+#endif
+#if defined(RT_SSE)
+        if (isa >= Isa::SSE2) {
+            return chooseKernel<TriangleBlockKernel>("triangle blocks", Isa::SSE2, triangleBlockSse);
+        }
+#endif
+        return chooseKernel<TriangleBlockKernel>("triangle blocks", Isa::Scalar, triangleBlockScalar);
+    }();
+    return kernel(ray, v0x, v0y, v0z, edge1x, edge1y, edge1z, edge2x, edge2y, edge2z, distances);
+}
+
+bool intersectShape(const Ray& ray, const Shape* shape, float& distance) {
+    switch (shape->type) {
+    case ShapeType::Sphere: {
+        const Sphere* sphere = static_cast<const Sphere*>(shape);
+        return intersectSphere(ray, sphere->center, sphere->radiusSquared, distance);
+    }
+    case ShapeType::Cylinder: {
+        const Cylinder* cylinder = static_cast<const Cylinder*>(shape);
+        return intersectCylinder(ray, cylinder->center, cylinder->frame, distance);
+    }
+    case ShapeType::Triangle: {
+        const Triangle* triangle = static_cast<const Triangle*>(shape);
+        return intersectTriangle(ray, triangle->v0, triangle->edge1, triangle->edge2, distance);
+    }
+    default:
+        return false;
+    }
+}
+
+bool intersectPrimitive(const Ray& ray, Shape* shape, Hit& hit) {
+    if (shape->type == ShapeType::Instance) {
+        return static_cast<const Instance*>(shape)->intersect(ray, hit);
+    }
+    float distance;
+    if (intersectShape(ray, shape, distance) && distance < hit.distance) {
+        hit.distance = distance;
+        hit.shape = shape;
+        hit.instance = nullptr;
+        return true;
+    }
+    return false;
+}
+
+bool occludedPrimitive(const Ray& ray, Shape* shape, float tMax) {
+    switch (shape->type) {
+    case ShapeType::Sphere: {
+        const Sphere* sphere = static_cast<const Sphere*>(shape);
+        return occludeSphere(ray, sphere->center, sphere->radiusSquared, tMax);
+    }
+    case ShapeType::Cylinder: {
+        const Cylinder* cylinder = static_cast<const Cylinder*>(shape);
+        return occludeCylinder(ray, cylinder->center, cylinder->frame, tMax);
+    }
+    case ShapeType::Triangle: {
+        const Triangle* triangle = static_cast<const Triangle*>(shape);
+        return occludeTriangle(ray, triangle->v0, triangle->edge1, triangle->edge2, tMax);
+    }
+    case ShapeType::Instance:
+        return static_cast<const Instance*>(shape)->occluded(ray, tMax);
+    }
+    return false;
+}
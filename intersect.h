@@ -0,0 +1,41 @@
+#ifndef INTERSECT_H
+#define INTERSECT_H
+#include "base.h"
+
+// Kernels on the raw parameters of each shape type, shared by the Shape-based tests
+// below and by ShapePool. Closest-hit kernels write the nearest distance in front of the
+// ray origin; any-hit kernels report whether some surface lies in (0, tMax).
+// They read the data Shape::prepare derives rather than recomputing it per ray.
+bool intersectSphere(const Ray& ray, const Vector3& center, float radiusSquared, float& distance);
+bool intersectCylinder(const Ray& ray, const Vector3& center, const CylinderFrame& frame, float& distance);
+bool intersectTriangle(const Ray& ray, const Vector3& v0, const Vector3& edge1, const Vector3& edge2, float& distance);
+bool occludeSphere(const Ray& ray, const Vector3& center, float radiusSquared, float tMax);
+bool occludeCylinder(const Ray& ray, const Vector3& center, const CylinderFrame& frame, float tMax);
+bool occludeTriangle(const Ray& ray, const Vector3& v0, const Vector3& edge1, const Vector3& edge2, float tMax);
+
+// Block kernels: one ray against kBlockSize consecutive shapes of a structure-of-arrays
+// pool, each pointer addressing the block's first entry. They return the mask of lanes
+// hit in front of the origin and store each hit lane's distance, equal to what the
+// single-shape kernel computes. A block is one pass of 8-lane instructions on AVX2 CPUs,
+// two passes of 4 SSE lanes below that, or a loop over the single-shape kernels, picked
+// at startup by cpu.h.
+const int kBlockSize = 8;
+int intersectSphereBlock(const Ray& ray, const float* centerX, const float* centerY, const float* centerZ,
+                         const float* radiusSquared, float* distances);
+int intersectTriangleBlock(const Ray& ray, const float* v0x, const float* v0y, const float* v0z, const float* edge1x,
+                           const float* edge1y, const float* edge1z, const float* edge2x, const float* edge2y,
+                           const float* edge2z, float* distances);
+
+// Ray-primitive test shared by the renderer and the acceleration structures.
+// On a hit in front of the ray origin, writes the nearest distance and returns true.
+bool intersectShape(const Ray& ray, const Shape* shape, float& distance);
+
+// Tests one acceleration-structure primitive and updates hit when it is closer than
+// hit.distance. Instances descend into their mesh.
+bool intersectPrimitive(const Ray& ray, Shape* shape, Hit& hit);
+
+// Any-hit test for shadow rays: true if the primitive blocks the ray before tMax.
+// Skips choosing the nearest root, so it is cheaper than intersectPrimitive.
+bool occludedPrimitive(const Ray& ray, Shape* shape, float tMax);
+
+#endif // INTERSECT_H
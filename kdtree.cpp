@@ -0,0 +1,290 @@
+#include <cmath>
+#include <numeric>
+#include "kdtree.h"
+#include "intersect.h"
+
+namespace {
+// SAH constants in the usual kd-tree proportions: a primitive test costs far more than a
+// traversal step, and splits that cut off empty space get a bonus
+const float kTraversalCost = 1.0f;
+const float kIntersectionCost = 80.0f;
+const float kEmptyBonus = 0.5f;
+const int kMaxLeafSize = 1;
+// Splits that make the SAH cost worse are allowed this many times along a path, in case
+// a better split follows
+const int kMaxBadRefines = 3;
+
+struct Edge {
+    float t;
+    int prim;
+    bool start;
+
+    // Starts sort before ends at the same position
+    bool operator<(const Edge& other) const {
+        return t < other.t || (t == other.t && start && !other.start);
+    }
+};
+
+Vector3 withComponent(const Vector3& v, int axis, float value) {
+    return Vector3(axis == 0 ? value : v.x, axis == 1 ? value : v.y, axis == 2 ? value : v.z);
+}
+}
+
+void KdTree::build(const std::vector<Shape*>& input) {
+    shapes = input;
+    nodes.clear();
+    leaves.clear();
+    primitives.clear();
+    bounds = AABB();
+    if (shapes.empty()) {
+        return;
+    }
+
+    int n = static_cast<int>(shapes.size());
+    primBounds.resize(n);
+    for (int i = 0; i < n; ++i) {
+        primBounds[i] = shapes[i]->getBounds();
+        bounds.expand(primBounds[i]);
+    }
+
+    std::vector<int> prims(n);
+    std::iota(prims.begin(), prims.end(), 0);
+    int maxDepth = static_cast<int>(std::lround(8 + 1.3f * std::log2(static_cast<float>(n))));
+    nodes.push_back(Node());
+    subdivide(0, bounds, prims, maxDepth, 0);
+    primBounds.clear();
+
+    int ropes[6] = {-1, -1, -1, -1, -1, -1};
+    attachRopes(0, bounds, ropes);
+}
+
+float KdTree::refit() {
+    std::vector<Shape*> input = shapes;
+    build(input);
+    return 1.0f;
+}
+
+size_t KdTree::memoryUsage() const {
+    return nodes.size() * sizeof(Node) + leaves.size() * sizeof(Leaf) + primitives.size() * sizeof(Shape*);
+}
+
+void KdTree::subdivide(int nodeIndex, const AABB& nodeBounds, std::vector<int>& prims, int depth, int badRefines) {
+    int count = static_cast<int>(prims.size());
+    float totalArea = nodeBounds.surfaceArea();
+    if (count <= kMaxLeafSize || depth == 0 || totalArea <= 0.0f) {
+        makeLeaf(nodeIndex, nodeBounds, prims);
+        return;
+    }
+
+    // Sweep the sorted primitive extents along the longest axis, falling back to the
+    // others when no plane strictly inside the node is found
+    Vector3 extent = nodeBounds.extent();
+    std::vector<Edge> edges(2 * count);
+    float bestCost = std::numeric_limits<float>::max();
+    int bestAxis = -1;
+    int bestOffset = -1;
+    int axis = nodeBounds.longestAxis();
+    for (int attempt = 0; attempt < 3 && bestAxis < 0; ++attempt, axis = (axis + 1) % 3) {
+        for (int i = 0; i < count; ++i) {
+            const AABB& box = primBounds[prims[i]];
+            edges[2 * i] = {box.min[axis], prims[i], true};
+            edges[2 * i + 1] = {box.max[axis], prims[i], false};
+        }
+        std::sort(edges.begin(), edges.end());
+
+        int otherAxis0 = (axis + 1) % 3;
+        int otherAxis1 = (axis + 2) % 3;
+        float capArea = extent[otherAxis0] * extent[otherAxis1];
+        float sideLength = extent[otherAxis0] + extent[otherAxis1];
+        int below = 0;
+        int above = count;
+        for (int i = 0; i < 2 * count; ++i) {
+            if (!edges[i].start) {
+                --above;
+            }
+            float t = edges[i].t;
+            if (t > nodeBounds.min[axis] && t < nodeBounds.max[axis]) {
+                float belowArea = 2.0f * (capArea + (t - nodeBounds.min[axis]) * sideLength);
+                float aboveArea = 2.0f * (capArea + (nodeBounds.max[axis] - t) * sideLength);
+                float bonus = (below == 0 || above == 0) ? kEmptyBonus : 0.0f;
+                float cost = kTraversalCost +
+                    kIntersectionCost * (1.0f - bonus) * (belowArea * below + aboveArea * above) / totalArea;
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestOffset = i;
+                }
+            }
+            if (edges[i].start) {
+                ++below;
+            }
+        }
+    }
+
+    float leafCost = kIntersectionCost * count;
+    if (bestCost > leafCost) {
+        ++badRefines;
+    }
+    if (bestAxis < 0 || badRefines == kMaxBadRefines || (bestCost > 4.0f * leafCost && count < 16)) {
+        makeLeaf(nodeIndex, nodeBounds, prims);
+        return;
+    }
+
+    // Primitives starting before the plane go below, those ending after it go above;
+    // the edges are still sorted along the chosen axis
+    std::vector<int> belowPrims, abovePrims;
+    for (int i = 0; i < bestOffset; ++i) {
+        if (edges[i].start) {
+            belowPrims.push_back(edges[i].prim);
+        }
+    }
+    for (int i = bestOffset + 1; i < 2 * count; ++i) {
+        if (!edges[i].start) {
+            abovePrims.push_back(edges[i].prim);
+        }
+    }
+    float split = edges[bestOffset].t;
+    std::vector<Edge>().swap(edges);
+    std::vector<int>().swap(prims);
+
+    int belowChild = static_cast<int>(nodes.size());
+    nodes.push_back(Node());
+    nodes.push_back(Node());
+    nodes[nodeIndex] = {split, bestAxis, belowChild};
+    subdivide(belowChild, AABB(nodeBounds.min, withComponent(nodeBounds.max, bestAxis, split)), belowPrims,
+              depth - 1, badRefines);
+    subdivide(belowChild + 1, AABB(withComponent(nodeBounds.min, bestAxis, split), nodeBounds.max), abovePrims,
+              depth - 1, badRefines);
+}
+
+void KdTree::makeLeaf(int nodeIndex, const AABB& nodeBounds, const std::vector<int>& prims) {
+    Leaf leaf;
+    leaf.bounds = nodeBounds;
+    leaf.first = static_cast<int>(primitives.size());
+    leaf.count = static_cast<int>(prims.size());
+    for (int prim : prims) {
+        primitives.push_back(shapes[prim]);
+    }
+    nodes[nodeIndex] = {0.0f, kLeaf, static_cast<int>(leaves.size())};
+    leaves.push_back(leaf);
+}
+
+void KdTree::attachRopes(int nodeIndex, const AABB& nodeBounds, int ropes[6]) {
+    // Push each rope down to the smallest node that still covers the whole face
+    for (int face = 0; face < 6; ++face) {
+        int faceAxis = face / 2;
+        bool maxFace = face & 1;
+        int rope = ropes[face];
+        while (rope >= 0 && nodes[rope].axis != kLeaf) {
+            const Node& target = nodes[rope];
+            if (target.axis == faceAxis) {
+                // The neighbour starts at the face, so only its near child touches it
+                rope = maxFace ? target.index : target.index + 1;
+            } else if (nodeBounds.max[target.axis] <= target.split) {
+                rope = target.index;
+            } else if (nodeBounds.min[target.axis] >= target.split) {
+                rope = target.index + 1;
+            } else {
+                break;
+            }
+        }
+        ropes[face] = rope;
+    }
+
+    const Node& node = nodes[nodeIndex];
+    if (node.axis == kLeaf) {
+        std::copy(ropes, ropes + 6, leaves[node.index].ropes);
+        return;
+    }
+    int axis = node.axis;
+    int belowChild = node.index;
+    int belowRopes[6], aboveRopes[6];
+    std::copy(ropes, ropes + 6, belowRopes);
+    std::copy(ropes, ropes + 6, aboveRopes);
+    belowRopes[2 * axis + 1] = belowChild + 1;
+    aboveRopes[2 * axis] = belowChild;
+    attachRopes(belowChild, AABB(nodeBounds.min, withComponent(nodeBounds.max, axis, node.split)), belowRopes);
+    attachRopes(belowChild + 1, AABB(withComponent(nodeBounds.min, axis, node.split), nodeBounds.max), aboveRopes);
+}
+
+int KdTree::findLeaf(int nodeIndex, const Vector3& point, const Vector3& direction) const {
+    while (nodes[nodeIndex].axis != kLeaf) {
+        const Node& node = nodes[nodeIndex];
+        float p = point[node.axis];
+        // A point on the plane belongs to the side the ray is heading into
+        bool below = p < node.split || (p == node.split && direction[node.axis] <= 0.0f);
+        nodeIndex = below ? node.index : node.index + 1;
+    }
+    return nodes[nodeIndex].index;
+}
+
+template <typename Visit>
+void KdTree::walk(const Ray& ray, float tMax, Visit visit) const {
+    if (nodes.empty()) {
+        return;
+    }
+    Vector3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    float tEnter;
+    if (!bounds.intersect(ray, invDir, tMax, tEnter)) {
+        return;
+    }
+    tEnter = std::max(tEnter, 0.0f);
+
+    int leafIndex = findLeaf(0, ray.origin + ray.direction * tEnter, ray.direction);
+    while (true) {
+        const Leaf& leaf = leaves[leafIndex];
+        // The ray leaves through the nearest of the three faces it is heading towards
+        float tExit = std::numeric_limits<float>::max();
+        int exitFace = -1;
+        for (int axis = 0; axis < 3; ++axis) {
+            float direction = ray.direction[axis];
+            if (direction == 0.0f) {
+                continue;
+            }
+            float plane = direction > 0.0f ? leaf.bounds.max[axis] : leaf.bounds.min[axis];
+            float t = (plane - ray.origin[axis]) * invDir[axis];
+            if (t < tExit) {
+                tExit = t;
+                exitFace = 2 * axis + (direction > 0.0f ? 1 : 0);
+            }
+        }
+        if (visit(leaf, tExit) || tExit >= tMax || exitFace < 0) {
+            return;
+        }
+        int next = leaf.ropes[exitFace];
+        if (next < 0) {
+            return;
+        }
+        leafIndex = findLeaf(next, ray.origin + ray.direction * tExit, ray.direction);
+    }
+}
+
+bool KdTree::intersect(const Ray& ray, Hit& hit) const {
+    bool found = false;
+    walk(ray, hit.distance, [&](const Leaf& leaf, float tExit) {
+        for (int i = leaf.first; i < leaf.first + leaf.count; ++i) {
+            if (intersectPrimitive(ray, primitives[i], hit)) {
+                found = true;
+            }
+        }
+        // Primitives spanning several leaves may report a hit beyond this one; only a
+        // hit inside the leaf is sure to be the closest
+        return hit.distance <= tExit;
+    });
+    return found;
+}
+
+bool KdTree::occluded(const Ray& ray, float tMax, Shape*& blocker) const {
+    bool blocked = false;
+    walk(ray, tMax, [&](const Leaf& leaf, float) {
+        for (int i = leaf.first; i < leaf.first + leaf.count; ++i) {
+            if (occludedPrimitive(ray, primitives[i], tMax)) {
+                blocker = primitives[i];
+                blocked = true;
+                return true;
+            }
+        }
+        return false;
+    });
+    return blocked;
+}
@@ -0,0 +1,56 @@
+#ifndef KDTREE_H
+#define KDTREE_H
+#include <vector>
+#include "base.h"
+#include "accel.h"
+
+// SAH kd-tree with ropes. Space is cut by axis-aligned planes, and a primitive that
+// straddles a plane is referenced from both sides. Every leaf stores its box and one
+// rope per face, which links to the smallest node covering that whole face. Traversal
+// therefore needs no stack: a ray finds its entry leaf once, then walks from leaf to
+// leaf through the face it leaves by.
+class KdTree : public Accelerator {
+public:
+    static constexpr int kLeaf = 3;  // Node::axis value of a leaf
+
+    struct Node {
+        float split;
+        int axis;   // Split axis of an interior node, kLeaf for leaves
+        int index;  // Below child for interior nodes (the above child follows it), leaf index for leaves
+    };
+    struct Leaf {
+        AABB bounds;
+        int ropes[6];  // Neighbour node through the -x, +x, -y, +y, -z, +z face; -1 leaves the tree
+        int first;     // Primitive range in the reference list
+        int count;
+    };
+
+    void build(const std::vector<Shape*>& shapes) override;
+    // Planes cannot follow moving shapes, so a refit is a rebuild
+    float refit() override;
+    bool intersect(const Ray& ray, Hit& hit) const override;
+    bool occluded(const Ray& ray, float tMax, Shape*& blocker) const override;
+    size_t memoryUsage() const override;
+    const char* name() const override { return "kdtree"; }
+
+private:
+    std::vector<Shape*> shapes;
+    AABB bounds;
+    std::vector<Node> nodes;
+    std::vector<Leaf> leaves;
+    std::vector<Shape*> primitives;
+
+    // Per-shape bounds used only while building
+    std::vector<AABB> primBounds;
+
+    void subdivide(int nodeIndex, const AABB& nodeBounds, std::vector<int>& prims, int depth, int badRefines);
+    void makeLeaf(int nodeIndex, const AABB& nodeBounds, const std::vector<int>& prims);
+    void attachRopes(int nodeIndex, const AABB& nodeBounds, int ropes[6]);
+    // Descends from a node (the root or a rope target) to the leaf containing point
+    int findLeaf(int nodeIndex, const Vector3& point, const Vector3& direction) const;
+    // Walks the leaves along the ray; visit(leaf, tLeafExit) returns true to stop
+    template <typename Visit>
+    void walk(const Ray& ray, float tMax, Visit visit) const;
+};
+
+#endif // KDTREE_H
@@ -0,0 +1,175 @@
+#include <cmath>
+#include <algorithm>
+#include "lighttree.h"
+
+namespace {
+const float kPi = 3.14159265f;
+
+float maxChannel(const Color& color) {
+    return std::max(color.r, std::max(color.g, color.b));
+}
+
+float angleBetween(const Vector3& a, const Vector3& b) {
+    float lengths = Vector3::length(a) * Vector3::length(b);
+    if (lengths <= 0.0f) {
+        return 0.0f;
+    }
+    return std::acos(std::max(-1.0f, std::min(1.0f, Vector3::dot(a, b) / lengths)));
+}
+
+// The diffuse and specular terms over cosines of angles in [lo, hi]
+float diffuseTerm(float angle) {
+    return std::max(std::cos(angle), 0.0f);
+}
+float specularTerm(float angle, float shininess) {
+    return std::pow(std::max(std::cos(angle), 0.0f), shininess) * 0.5f;
+}
+
+// Range of the Blinn-Phong terms over every light position inside a box. The directions
+// to the box lie in a cone of half-angle theta around the direction to its center. The
+// half vector normalize(v + l) turns by at most dl / |v + l| as l turns by dl, which
+// bounds how far it strays from the half vector of the cone's axis.
+void termBounds(const AABB& box, const Vector3& point, const Vector3& normal, const Vector3& viewDirection,
+                float shininess, float& diffMin, float& diffMax, float& specMin, float& specMax) {
+    Vector3 toCenter = box.centroid() - point;
+    float distance = Vector3::length(toCenter);
+    float radius = 0.5f * Vector3::length(box.extent());
+    float diffLo = 0.0f, diffHi = kPi, specLo = 0.0f, specHi = kPi;
+    if (distance > radius) {
+        float theta = std::asin(radius / distance);
+        float alpha = angleBetween(normal, toCenter);
+        diffLo = std::max(0.0f, alpha - theta);
+        diffHi = std::min(kPi, alpha + theta);
+
+        float viewLength = Vector3::length(viewDirection);
+        float widest = angleBetween(viewDirection, toCenter) + theta;
+        float minHalfLength = widest < kPi ?
+            std::sqrt(std::max(viewLength * viewLength + 1.0f + 2.0f * viewLength * std::cos(widest), 0.0f)) : 0.0f;
+        if (minHalfLength > 0.0f) {
+            float deviation = theta / minHalfLength;
+            float gamma = angleBetween(normal, viewDirection + toCenter * (1.0f / distance));
+            specLo = std::max(0.0f, gamma - deviation);
+            specHi = std::min(kPi, gamma + deviation);
+        }
+    }
+    diffMin = diffuseTerm(diffHi);
+    diffMax = diffuseTerm(diffLo);
+    specMin = specularTerm(specHi, shininess);
+    specMax = specularTerm(specLo, shininess);
+}
+}
+
+void blinnPhongTerms(const Vector3& point, const Vector3& normal, const Vector3& viewDirection, float shininess,
+                     const Vector3& lightPosition, float& diff, float& spec) {
+    Vector3 lightDir = (lightPosition - point).normalize(); // Direction from point to light
+    Vector3 halfVector = (viewDirection + lightDir).normalize(); // Halfway vector between view direction and light direction
+    diff = std::max(Vector3::dot(normal, lightDir), 0.0f);
+
+    // Reduce the intensity of the specular reflection if it's too strong
+    float specularIntensityReduction = 0.5f;
+    spec = std::pow(std::max(Vector3::dot(normal, halfVector), 0.0f), shininess) * specularIntensityReduction;
+}
+
+void LightTree::build(const std::vector<LightSource*>& input) {
+    lights.assign(input.begin(), input.end());
+    nodes.clear();
+    if (lights.empty()) {
+        return;
+    }
+    std::vector<int> order(lights.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = static_cast<int>(i);
+    }
+    nodes.reserve(2 * lights.size() - 1);
+    nodes.push_back(Node());
+    subdivide(0, order, 0, static_cast<int>(order.size()));
+}
+
+void LightTree::subdivide(int nodeIndex, std::vector<int>& order, int first, int count) {
+    Node node;
+    node.child = -1;
+    for (int i = first; i < first + count; ++i) {
+        node.bounds.expand(lights[order[i]]->position);
+        node.intensity += lights[order[i]]->intensity;
+    }
+    if (count == 1) {
+        node.representative = order[first];
+        nodes[nodeIndex] = node;
+        return;
+    }
+
+    // Median split along the longest axis of the light positions
+    int axis = node.bounds.longestAxis();
+    int half = count / 2;
+    std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+                     [&](int a, int b) { return lights[a]->position[axis] < lights[b]->position[axis]; });
+    node.child = static_cast<int>(nodes.size());
+    nodes.push_back(Node());
+    nodes.push_back(Node());
+    subdivide(node.child, order, first, half);
+    subdivide(node.child + 1, order, first + half, count - half);
+
+    // The representative comes from the brighter half, so it sits where most of the
+    // cluster's light comes from
+    const Node& left = nodes[node.child];
+    const Node& right = nodes[node.child + 1];
+    node.representative = maxChannel(left.intensity) >= maxChannel(right.intensity) ?
+        left.representative : right.representative;
+    nodes[nodeIndex] = node;
+}
+
+void LightTree::selectCut(const Vector3& point, const Vector3& normal, const Material& material,
+                          const Vector3& viewDirection, float relativeError, LightCut& cut) const {
+    cut.lights.clear();
+    cut.pointers.clear();
+    cut.indices.clear();
+    cut.heap.clear();
+    if (nodes.empty()) {
+        return;
+    }
+    float shininess = material.specularExponent;
+    Color total = Color(1, 1, 1) * material.ambientColor;
+
+    auto push = [&](int nodeIndex) {
+        const Node& node = nodes[nodeIndex];
+        float diff, spec;
+        blinnPhongTerms(point, normal, viewDirection, shininess, lights[node.representative]->position, diff, spec);
+        LightCut::Entry entry;
+        entry.node = nodeIndex;
+        entry.estimate = node.intensity * (material.diffuseColor * diff + material.specularColor * spec);
+        entry.error = 0.0f;
+        if (node.child >= 0) {
+            float diffMin, diffMax, specMin, specMax;
+            termBounds(node.bounds, point, normal, viewDirection, shininess, diffMin, diffMax, specMin, specMax);
+            Color spread = material.diffuseColor * (diffMax - diffMin) + material.specularColor * (specMax - specMin);
+            entry.error = maxChannel(node.intensity * spread);
+        }
+        total += entry.estimate;
+        cut.heap.push_back(entry);
+        std::push_heap(cut.heap.begin(), cut.heap.end());
+    };
+
+    // Refine the cluster with the largest error bound until every bound is acceptable
+    push(0);
+    while (static_cast<int>(cut.heap.size()) < kMaxCutSize) {
+        const LightCut::Entry& worst = cut.heap.front();
+        if (worst.error <= 0.0f || worst.error <= relativeError * maxChannel(total)) {
+            break;
+        }
+        int child = nodes[worst.node].child;
+        total -= worst.estimate;
+        std::pop_heap(cut.heap.begin(), cut.heap.end());
+        cut.heap.pop_back();
+        push(child);
+        push(child + 1);
+    }
+
+    for (const LightCut::Entry& entry : cut.heap) {
+        const Node& node = nodes[entry.node];
+        cut.lights.push_back(LightSource(lights[node.representative]->position, node.intensity));
+        cut.indices.push_back(node.representative);
+    }
+    for (LightSource& light : cut.lights) {
+        cut.pointers.push_back(&light);
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef LIGHTTREE_H
+#define LIGHTTREE_H
+#include <vector>
+#include "base.h"
+
+// Per-light Blinn-Phong terms at a surface point: the cosine factor scaling the diffuse
+// color and the (already halved) specular coefficient scaling the specular color
+void blinnPhongTerms(const Vector3& point, const Vector3& normal, const Vector3& viewDirection, float shininess,
+                     const Vector3& lightPosition, float& diff, float& spec);
+
+// Lights picked to shade one point: each stands for a cluster of scene lights, placed at
+// the cluster's representative light and carrying the cluster's total intensity
+struct LightCut {
+    std::vector<LightSource> lights;
+    std::vector<LightSource*> pointers;  // The same lights, as calculateLocalIllumination takes them
+    std::vector<int> indices;            // Scene index of each representative
+
+    struct Entry {
+        float error;
+        int node;
+        Color estimate;
+        bool operator<(const Entry& other) const { return error < other.error; }
+    };
+    std::vector<Entry> heap;  // Scratch space of LightTree::selectCut
+};
+
+// Binary bounding hierarchy over the point lights, in the manner of lightcuts. Every node
+// stores the box of its lights, their summed intensity and one representative light.
+// Shading a point walks down from the root and stops refining a cluster once the bound
+// on the error of lighting with its representative alone is small against the point's
+// total, so the lights used per point grow far slower than the light count.
+class LightTree {
+public:
+    struct Node {
+        AABB bounds;
+        Color intensity;     // Sum over the cluster
+        int representative;  // Scene index of the light that stands for the cluster
+        int child;           // First of two consecutive children, -1 for a single light
+    };
+
+    // Cuts never hold more clusters than this, whatever the error bound
+    static constexpr int kMaxCutSize = 1024;
+
+    void build(const std::vector<LightSource*>& lights);
+    bool empty() const { return nodes.empty(); }
+    // Chooses the clusters to shade a point with. relativeError is the largest error
+    // bound allowed per cluster as a fraction of the point's estimated color (ambient
+    // included); 0 refines down to the single lights.
+    void selectCut(const Vector3& point, const Vector3& normal, const Material& material, const Vector3& viewDirection,
+                   float relativeError, LightCut& cut) const;
+
+private:
+    std::vector<const LightSource*> lights;
+    std::vector<Node> nodes;
+
+    void subdivide(int nodeIndex, std::vector<int>& order, int first, int count);
+};
+
+#endif // LIGHTTREE_H
@@ -0,0 +1,112 @@
+#include "pixels.h"
+#include "cpu.h"
+#include "simd.h"
+
+namespace {
+typedef void (*QuantizeKernel)(const float*, size_t, unsigned char*);
+typedef void (*ExpandKernel)(const uint16_t*, size_t, float*);
+
+void quantizeScalar(const float* values, size_t count, unsigned char* bytes) {
+    for (size_t i = 0; i < count; ++i) {
+        bytes[i] = static_cast<unsigned char>(values[i] * 255);
+    }
+}
+
+// The vector variants convert 16 channels per step and leave the rest to the scalar
+// loop. Their saturating packs agree with the scalar cast on every value in [0, 1].
+#if defined(RT_SSE)
+void quantizeSse(const float* values, size_t count, unsigned char* bytes) {
+    const __m128 scale = _mm_set1_ps(255.0f);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(values + i), scale));
+        __m128i b = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(values + i + 4), scale));
+        __m128i c = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(values + i + 8), scale));
+        __m128i d = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(values + i + 12), scale));
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bytes + i), packed);
+    }
+    quantizeScalar(values + i, count - i, bytes + i);
+}
+#endif
+
+#if defined(RT_DISPATCH)
+RT_TARGET("avx2")
+void quantizeAvx2(const float* values, size_t count, unsigned char* bytes) {
+    const __m256 scale = _mm256_set1_ps(255.0f);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i a = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_loadu_ps(values + i), scale));
+        __m256i b = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_loadu_ps(values + i + 8), scale));
+        // The pack works within 128-bit halves; the permute puts the 16-bit values back in order
+        __m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xd8);
+        __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bytes + i), packed);
+    }
+    quantizeScalar(values + i, count - i, bytes + i);
+}
+
+RT_TARGET("avx512f")
+void quantizeAvx512(const float* values, size_t count, unsigned char* bytes) {
+    const __m512 scale = _mm512_set1_ps(255.0f);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        // The zero-masked forms, with every lane enabled, are the plain conversions
+        __m512i words = _mm512_maskz_cvttps_epi32(0xffff, _mm512_mul_ps(_mm512_loadu_ps(values + i), scale));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bytes + i), _mm512_maskz_cvtusepi32_epi8(0xffff, words));
+    }
+    quantizeScalar(values + i, count - i, bytes + i);
+}
+#endif
+
+void expandScalar(const uint16_t* halves, size_t count, float* values) {
+    for (size_t i = 0; i < count; ++i) {
+        values[i] = halfToFloat(halves[i]);
+    }
+}
+
+#if defined(RT_DISPATCH)
+RT_TARGET("avx2,f16c")
+void expandF16c(const uint16_t* halves, size_t count, float* values) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(halves + i));
+        _mm256_storeu_ps(values + i, _mm256_cvtph_ps(packed));
+    }
+    expandScalar(halves + i, count - i, values + i);
+}
+#endif
+}
+
+void quantizeChannels(const float* values, size_t count, unsigned char* bytes) {
+    static const QuantizeKernel kernel = [] {
+        Isa isa = selectedIsa();
+#if defined(RT_DISPATCH)
+        if (isa >= Isa::AVX512) {
+            return chooseKernel<QuantizeKernel>("pixel conversions", Isa::AVX512, quantizeAvx512);
+        }
+        if (isa >= Isa::AVX2) {
+            return chooseKernel<QuantizeKernel>("pixel conversions", Isa::AVX2, quantizeAvx2);
+        }
+#endif
+#if defined(RT_SSE)
+        if (isa >= Isa::SSE2) {
+            return chooseKernel<QuantizeKernel>("pixel conversions", Isa::SSE2, quantizeSse);
+        }
+#endif
+        return chooseKernel<QuantizeKernel>("pixel conversions", Isa::Scalar, quantizeScalar);
+    }();
+    kernel(values, count, bytes);
+}
+
+void expandHalves(const uint16_t* halves, size_t count, float* values) {
+    static const ExpandKernel kernel = [] {
+#if defined(RT_DISPATCH)
+        if (selectedIsa() >= Isa::AVX2) {
+            return chooseKernel<ExpandKernel>("half-float conversions", Isa::AVX2, expandF16c);
+        }
+#endif
+        return chooseKernel<ExpandKernel>("half-float conversions", Isa::Scalar, expandScalar);
+    }();
+    kernel(halves, count, values);
+}
@@ -0,0 +1,65 @@
+#ifndef PIXELS_H
+#define PIXELS_H
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Converts count color channels in [0, 1] to bytes, truncating value * 255 as
+// Color::getAsIntegers does. Runs the SSE2, AVX2 or AVX-512 variant cpu.h selects.
+void quantizeChannels(const float* values, size_t count, unsigned char* bytes);
+
+// IEEE half-precision conversions, rounding to nearest even. Values beyond the half range
+// become infinities and NaNs stay NaNs.
+inline uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t magnitude = bits & 0x7fffffff;
+    if (magnitude >= 0x7f800000) {
+        return static_cast<uint16_t>(sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0));
+    }
+    if (magnitude >= 0x477ff000) {
+        return static_cast<uint16_t>(sign | 0x7c00); // Rounds above 65504
+    }
+    uint32_t result, remainder, halfway;
+    if (magnitude >= 0x38800000) {
+        // Normal: rebias the exponent and drop 13 mantissa bits; a carry moves into the exponent
+        result = (magnitude - 0x38000000) >> 13;
+        remainder = magnitude & 0x1fff;
+        halfway = 0x1000;
+    } else if (magnitude >= 0x33000000) {
+        // Subnormal: the mantissa with its implicit bit, in units of 2^-24
+        int shift = 126 - static_cast<int>(magnitude >> 23);
+        uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+        result = mantissa >> shift;
+        remainder = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    } else {
+        return static_cast<uint16_t>(sign);
+    }
+    if (remainder > halfway || (remainder == halfway && (result & 1))) {
+        ++result;
+    }
+    return static_cast<uint16_t>(sign | result);
+}
+
+inline float halfToFloat(uint16_t half) {
+    uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    if (exponent == 0) {
+        // Zero or subnormal, exact as a float
+        float value = mantissa * (1.0f / 16777216.0f);
+        return sign ? -value : value;
+    }
+    uint32_t bits = exponent == 0x1f ? sign | 0x7f800000 | (mantissa << 13)
+                                     : sign | ((exponent + 112) << 23) | (mantissa << 13);
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// halfToFloat over count values; the AVX2 variant uses F16C
+void expandHalves(const uint16_t* halves, size_t count, float* values);
+
+#endif // PIXELS_H
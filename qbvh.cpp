@@ -0,0 +1,408 @@
+#include "qbvh.h"
+#include <cstring>
+#include "bvh.h"
+#include "intersect.h"
+#include "scenecache.h"
+#include "simd.h"
+
+static_assert(sizeof(QuantizedBVH::Node) == 64, "quantized node must fill exactly one cache line");
+
+namespace {
+const float kTraversalCost = 1.0f;
+const float kIntersectionCost = 1.0f;
+const int kMaxLeafSize = 254;
+// Four children per level over a binary tree whose depth is capped at 60
+const int kStackSize = 4 * 64;
+
+struct StackEntry {
+    uint32_t index;  // Node index, or first primitive for leaves
+    int count;       // Leaf primitive count, 0 for interior nodes
+    float tNear;
+};
+
+// 2^e for the exponents a node can store, built directly from the float bit pattern
+inline float exp2i(int e) {
+    uint32_t bits = static_cast<uint32_t>(e + 127) << 23;
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+// Greedily opens the interior child with the largest area until kWidth slots are used
+int collectSlots(const std::vector<BVH::Node>& source, int binaryIndex, int* slots) {
+    int slotCount = 1;
+    slots[0] = binaryIndex;
+    while (slotCount < QuantizedBVH::kWidth) {
+        int largest = -1;
+        float largestArea = -1.0f;
+        for (int i = 0; i < slotCount; ++i) {
+            const BVH::Node& candidate = source[slots[i]];
+            if (!candidate.isLeaf() && candidate.bounds.surfaceArea() > largestArea) {
+                largestArea = candidate.bounds.surfaceArea();
+                largest = i;
+            }
+        }
+        if (largest < 0) {
+            break;
+        }
+        int opened = slots[largest];
+        slots[largest] = source[opened].leftFirst;
+        slots[slotCount++] = source[opened].leftFirst + 1;
+    }
+    return slotCount;
+}
+}
+
+void QuantizedBVH::build(const std::vector<Shape*>& shapes) {
+    nodes.clear();
+    primitives.clear();
+    builtCost = 0.0f;
+    if (shapes.empty()) {
+        return;
+    }
+
+    // Build a binary SAH tree, collapse it into quantized 4-wide nodes and drop it
+    BVH binary;
+    binary.build(shapes);
+    primitives = binary.getPrimitives();
+    const std::vector<BVH::Node>& source = binary.getNodes();
+    nodes.reserve(source.size() / 3 + 1);
+
+    // Explicit work list: each entry is a binary node and the wide node it becomes
+    std::vector<std::pair<int, int>> pending;
+    nodes.emplace_back();
+    pending.push_back({0, 0});
+    while (!pending.empty()) {
+        int binaryIndex = pending.back().first;
+        int nodeIndex = pending.back().second;
+        pending.pop_back();
+
+        int slots[kWidth];
+        int slotCount = collectSlots(source, binaryIndex, slots);
+        AABB childBounds[kWidth];
+        for (int i = 0; i < kWidth; ++i) {
+            Node& node = nodes[nodeIndex];
+            if (i >= slotCount) {
+                node.child[i] = 0;
+                node.meta[i] = kEmpty;
+                continue;
+            }
+            const BVH::Node& child = source[slots[i]];
+            childBounds[i] = child.bounds;
+            if (child.isLeaf() && child.count <= kMaxLeafSize) {
+                node.child[i] = child.leftFirst;
+                node.meta[i] = static_cast<uint8_t>(child.count);
+            } else if (child.isLeaf()) {
+                int rangeNode = emitRange(child.leftFirst, child.count);
+                nodes[nodeIndex].child[i] = rangeNode;
+                nodes[nodeIndex].meta[i] = kInterior;
+            } else {
+                int childIndex = static_cast<int>(nodes.size());
+                nodes.emplace_back();
+                nodes[nodeIndex].child[i] = childIndex;
+                nodes[nodeIndex].meta[i] = kInterior;
+                pending.push_back({slots[i], childIndex});
+            }
+        }
+        encode(nodes[nodeIndex], childBounds);
+    }
+    builtCost = sahCost();
+}
+
+int QuantizedBVH::emitRange(int first, int count) {
+    // Oversized leaves (only produced at the binary builder's depth cap) are split into
+    // chunks that fit the 8-bit leaf size
+    int nodeIndex = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+    int chunk = (count + kWidth - 1) / kWidth;
+    AABB childBounds[kWidth];
+    for (int i = 0; i < kWidth; ++i) {
+        int start = first + i * chunk;
+        int size = std::min(chunk, first + count - start);
+        if (size <= 0) {
+            nodes[nodeIndex].child[i] = 0;
+            nodes[nodeIndex].meta[i] = kEmpty;
+            continue;
+        }
+        for (int j = start; j < start + size; ++j) {
+            childBounds[i].expand(primitives[j]->getBounds());
+        }
+        if (size <= kMaxLeafSize) {
+            nodes[nodeIndex].child[i] = start;
+            nodes[nodeIndex].meta[i] = static_cast<uint8_t>(size);
+        } else {
+            int childIndex = emitRange(start, size);
+            nodes[nodeIndex].child[i] = childIndex;
+            nodes[nodeIndex].meta[i] = kInterior;
+        }
+    }
+    encode(nodes[nodeIndex], childBounds);
+    return nodeIndex;
+}
+
+void QuantizedBVH::encode(Node& node, const AABB* childBounds) const {
+    AABB parent;
+    for (int i = 0; i < kWidth; ++i) {
+        if (node.meta[i] != kEmpty) {
+            parent.expand(childBounds[i]);
+        }
+    }
+    node.pad = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+        float origin = parent.min[axis];
+        float extent = parent.max[axis] - origin;
+        // Smallest power-of-two step for which 255 steps cover the extent, with a little
+        // slack so rounding in origin + 255 * step cannot fall short of the maximum
+        int exponent = -126;
+        if (extent > 0.0f) {
+            frexp(extent * (1.0f + 1e-5f) / 255.0f, &exponent);
+            exponent = std::max(-126, std::min(127, exponent));
+        }
+        float step = exp2i(exponent);
+        node.origin[axis] = origin;
+        node.exponent[axis] = static_cast<int8_t>(exponent);
+        for (int i = 0; i < kWidth; ++i) {
+            if (node.meta[i] == kEmpty) {
+                node.lo[axis][i] = 255;
+                node.hi[axis][i] = 0;
+                continue;
+            }
+            int lo = static_cast<int>(floor((childBounds[i].min[axis] - origin) / step));
+            int hi = static_cast<int>(ceil((childBounds[i].max[axis] - origin) / step));
+            lo = std::max(0, std::min(255, lo));
+            hi = std::max(0, std::min(255, hi));
+            // Round outwards until the decoded box really contains the child
+            while (lo > 0 && origin + lo * step > childBounds[i].min[axis]) {
+                --lo;
+            }
+            while (hi < 255 && origin + hi * step < childBounds[i].max[axis]) {
+                ++hi;
+            }
+            node.lo[axis][i] = static_cast<uint8_t>(lo);
+            node.hi[axis][i] = static_cast<uint8_t>(hi);
+        }
+    }
+}
+
+AABB QuantizedBVH::decode(const Node& node, int slot) const {
+    Vector3 step(exp2i(node.exponent[0]), exp2i(node.exponent[1]), exp2i(node.exponent[2]));
+    return AABB(Vector3(node.origin[0] + node.lo[0][slot] * step.x,
+                        node.origin[1] + node.lo[1][slot] * step.y,
+                        node.origin[2] + node.lo[2][slot] * step.z),
+                Vector3(node.origin[0] + node.hi[0][slot] * step.x,
+                        node.origin[1] + node.hi[1][slot] * step.y,
+                        node.origin[2] + node.hi[2][slot] * step.z));
+}
+
+float QuantizedBVH::refit() {
+    if (nodes.empty()) {
+        return 1.0f;
+    }
+    // Children are stored after their parents, so a reverse sweep sees them first
+    std::vector<AABB> nodeBounds(nodes.size());
+    for (int n = static_cast<int>(nodes.size()) - 1; n >= 0; --n) {
+        Node& node = nodes[n];
+        AABB childBounds[kWidth];
+        for (int i = 0; i < kWidth; ++i) {
+            if (node.meta[i] == kInterior) {
+                childBounds[i] = nodeBounds[node.child[i]];
+            } else if (node.meta[i] != kEmpty) {
+                for (uint32_t j = node.child[i]; j < node.child[i] + node.meta[i]; ++j) {
+                    childBounds[i].expand(primitives[j]->getBounds());
+                }
+            }
+            nodeBounds[n].expand(childBounds[i]);
+        }
+        encode(node, childBounds);
+    }
+    return builtCost > 0.0f ? sahCost() / builtCost : 1.0f;
+}
+
+float QuantizedBVH::sahCost() const {
+    if (nodes.empty()) {
+        return 0.0f;
+    }
+    AABB root;
+    for (int i = 0; i < kWidth; ++i) {
+        if (nodes[0].meta[i] != kEmpty) {
+            root.expand(decode(nodes[0], i));
+        }
+    }
+    float rootArea = root.surfaceArea();
+    if (rootArea <= 0.0f) {
+        return kIntersectionCost * static_cast<float>(primitives.size());
+    }
+    float cost = kTraversalCost * rootArea;
+    for (const Node& node : nodes) {
+        for (int i = 0; i < kWidth; ++i) {
+            if (node.meta[i] == kEmpty) {
+                continue;
+            }
+            float area = decode(node, i).surfaceArea();
+            cost += node.meta[i] == kInterior ? area * kTraversalCost : area * kIntersectionCost * node.meta[i];
+        }
+    }
+    return cost / rootArea;
+}
+
+bool QuantizedBVH::saveCache(CacheWriter& out, const std::vector<Shape*>& shapes) const {
+    out.write(builtCost);
+    out.write(nodes);
+    out.writeShapes(primitives, shapes);
+    return true;
+}
+
+bool QuantizedBVH::loadCache(CacheReader& in, const std::vector<Shape*>& shapes) {
+    nodes.clear();
+    primitives.clear();
+    if (!in.read(builtCost) || !in.read(nodes) || !in.readShapes(primitives, shapes)) {
+        nodes.clear();
+        primitives.clear();
+        return false;
+    }
+    // Reject child and primitive references that would index out of bounds
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        for (int slot = 0; slot < kWidth; ++slot) {
+            uint8_t meta = nodes[i].meta[slot];
+            uint32_t child = nodes[i].child[slot];
+            bool valid = meta == kEmpty ||
+                (meta == kInterior ? child > i && child < nodes.size() : child + meta <= primitives.size());
+            if (!valid) {
+                nodes.clear();
+                primitives.clear();
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+size_t QuantizedBVH::memoryUsage() const {
+    return nodes.size() * sizeof(Node) + primitives.size() * sizeof(Shape*);
+}
+
+int QuantizedBVH::intersectChildren(const Node& node, const Ray& ray, const Vector3& invDir, float tMax, float* tEnter) const {
+    int mask = 0;
+#if defined(RT_SSE)
+    // Decode the four child boxes on the fly: origin + q * 2^exponent per axis
+    __m128i zero = _mm_setzero_si128();
+    __m128 enter = _mm_setzero_ps();
+    __m128 exit = _mm_set1_ps(tMax);
+    for (int axis = 0; axis < 3; ++axis) {
+        int32_t packedLo, packedHi;
+        std::memcpy(&packedLo, node.lo[axis], sizeof(packedLo));
+        std::memcpy(&packedHi, node.hi[axis], sizeof(packedHi));
+        __m128i lo = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packedLo), zero), zero);
+        __m128i hi = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packedHi), zero), zero);
+        __m128 origin = _mm_set1_ps(node.origin[axis]);
+        __m128 step = _mm_set1_ps(exp2i(node.exponent[axis]));
+        __m128 boxMin = _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(lo), step));
+        __m128 boxMax = _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(hi), step));
+        __m128 rayOrigin = _mm_set1_ps(ray.origin[axis]);
+        __m128 inv = _mm_set1_ps(invDir[axis]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(boxMin, rayOrigin), inv);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(boxMax, rayOrigin), inv);
+        enter = _mm_max_ps(enter, _mm_min_ps(t0, t1));
+        exit = _mm_min_ps(exit, _mm_max_ps(t0, t1));
+    }
+    _mm_store_ps(tEnter, enter);
+    mask = _mm_movemask_ps(_mm_cmple_ps(enter, exit));
+#else
+    for (int i = 0; i < kWidth; ++i) {
+        if (decode(node, i).intersect(ray, invDir, tMax, tEnter[i])) {
+            mask |= 1 << i;
+        }
+    }
+#endif
+    // Unused slots decode to inverted boxes; never report them
+    for (int i = 0; i < kWidth; ++i) {
+        if (node.meta[i] == kEmpty) {
+            mask &= ~(1 << i);
+        }
+    }
+    return mask;
+}
+
+bool QuantizedBVH::intersect(const Ray& ray, Hit& hit) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    Vector3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+
+    bool found = false;
+    StackEntry stack[kStackSize];
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0, 0.0f};
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        if (entry.tNear > hit.distance) {
+            continue;
+        }
+        if (entry.count > 0) {
+            for (uint32_t i = entry.index; i < entry.index + entry.count; ++i) {
+                if (intersectPrimitive(ray, primitives[i], hit)) {
+                    found = true;
+                }
+            }
+            continue;
+        }
+
+        const Node& node = nodes[entry.index];
+        alignas(16) float tEnter[kWidth];
+        int mask = intersectChildren(node, ray, invDir, hit.distance, tEnter);
+
+        // Push the children that were hit far to near so the nearest is popped first
+        int order[kWidth];
+        int hitCount = 0;
+        for (int i = 0; i < kWidth; ++i) {
+            if (mask & (1 << i)) {
+                int j = hitCount++;
+                while (j > 0 && tEnter[order[j - 1]] < tEnter[i]) {
+                    order[j] = order[j - 1];
+                    --j;
+                }
+                order[j] = i;
+            }
+        }
+        for (int k = 0; k < hitCount; ++k) {
+            int i = order[k];
+            int count = node.meta[i] == kInterior ? 0 : node.meta[i];
+            stack[stackSize++] = {node.child[i], count, tEnter[i]};
+        }
+    }
+    return found;
+}
+
+bool QuantizedBVH::occluded(const Ray& ray, float tMax, Shape*& blocker) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    Vector3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+
+    // Leaf children are tested as soon as their box is hit and interior children are
+    // pushed unsorted; the first blocker ends the query
+    uint32_t stack[kStackSize];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const Node& node = nodes[stack[--stackSize]];
+        alignas(16) float tEnter[kWidth];
+        int mask = intersectChildren(node, ray, invDir, tMax, tEnter);
+        for (int i = 0; i < kWidth; ++i) {
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+            if (node.meta[i] == kInterior) {
+                stack[stackSize++] = node.child[i];
+                continue;
+            }
+            for (uint32_t j = node.child[i]; j < node.child[i] + node.meta[i]; ++j) {
+                if (occludedPrimitive(ray, primitives[j], tMax)) {
+                    blocker = primitives[j];
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
@@ -0,0 +1,52 @@
+#ifndef QBVH_H
+#define QBVH_H
+#include <cstdint>
+#include <vector>
+#include "base.h"
+#include "accel.h"
+
+// Compressed 4-wide BVH for very large scenes. Each node stores its own box as an origin
+// and a power-of-two scale per axis, and the four child boxes as 8-bit offsets on that
+// grid, rounded outwards so they stay conservative. With 32-bit child indices a node
+// fits exactly in one 64-byte cache line (the uncompressed bvh4 node takes 128 bytes).
+class QuantizedBVH : public Accelerator {
+public:
+    static constexpr int kWidth = 4;
+    static constexpr uint8_t kEmpty = 0;        // meta value of an unused child slot
+    static constexpr uint8_t kInterior = 0xFF;  // meta value of an interior child; 1..254 is a leaf size
+
+    struct alignas(64) Node {
+        float origin[3];
+        int8_t exponent[3];  // Quantization step per axis is 2^exponent
+        uint8_t pad;
+        uint8_t lo[3][kWidth];
+        uint8_t hi[3][kWidth];
+        uint32_t child[kWidth];  // Node index for interior children, first primitive for leaves
+        uint8_t meta[kWidth];
+        uint8_t reserved[4];
+    };
+
+    void build(const std::vector<Shape*>& shapes) override;
+    // Recomputes and requantizes all boxes bottom-up, keeping the topology
+    float refit() override;
+    bool intersect(const Ray& ray, Hit& hit) const override;
+    bool occluded(const Ray& ray, float tMax, Shape*& blocker) const override;
+    size_t memoryUsage() const override;
+    const char* name() const override { return "qbvh"; }
+    bool saveCache(CacheWriter& out, const std::vector<Shape*>& shapes) const override;
+    bool loadCache(CacheReader& in, const std::vector<Shape*>& shapes) override;
+
+private:
+    std::vector<Node> nodes;
+    std::vector<Shape*> primitives;
+    float builtCost = 0.0f;
+
+    int emitRange(int first, int count);
+    void encode(Node& node, const AABB* childBounds) const;
+    AABB decode(const Node& node, int slot) const;
+    // Decodes and tests the four child boxes; returns a bit mask of hits and entry distances
+    int intersectChildren(const Node& node, const Ray& ray, const Vector3& invDir, float tMax, float* tEnter) const;
+    float sahCost() const;
+};
+
+#endif // QBVH_H
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <cmath>
+#include "raygen.h"
+#include "head.h"
+#include "simd.h"
+
+void RayBuffer::resize(size_t count) {
+    originX.resize(count);
+    originY.resize(count);
+    originZ.resize(count);
+    directionX.resize(count);
+    directionY.resize(count);
+    directionZ.resize(count);
+}
+
+void CameraRayGenerator::setup(const Camera& camera) {
+    // The same expressions as computeRay, evaluated once per column and row
+    float tanFov = tan(camera.fov * M_PI / 360.0f);
+    columnX.resize(camera.width);
+    for (int x = 0; x < camera.width; ++x) {
+        float normalizedX = (2.0f * x / camera.width - 1.0f);
+        columnX[x] = normalizedX * tanFov * camera.width / camera.height;
+    }
+    rowY.resize(camera.height);
+    for (int y = 0; y < camera.height; ++y) {
+        float normalizedY = (1.0f - 2.0f * y / camera.height);
+        rowY[y] = normalizedY * tanFov;
+    }
+
+    Vector3 forward = Vector3::normalize(camera.lookAt - camera.position);
+    Vector3 right = Vector3::normalize(Vector3::cross(camera.upVector, forward));
+    Vector3 up = Vector3::cross(forward, right);
+    view = {
+        right.x, up.x, forward.x, 0,
+        right.y, up.y, forward.y, 0,
+        right.z, up.z, forward.z, 0,
+        -Vector3::dot(right, camera.position), -Vector3::dot(up, camera.position), -Vector3::dot(forward, camera.position), 1
+    };
+    origin = camera.position;
+}
+
+Ray CameraRayGenerator::ray(int x, int y) const {
+    return Ray(origin, view * Vector3(columnX[x], rowY[y], 1.0f));
+}
+
+void CameraRayGenerator::generateRow(int y, int x0, int count, RayBuffer& out, size_t offset) const {
+    float* outX = out.directionX.data() + offset;
+    float* outY = out.directionY.data() + offset;
+    float* outZ = out.directionZ.data() + offset;
+    std::fill(out.originX.begin() + offset, out.originX.begin() + offset + count, origin.x);
+    std::fill(out.originY.begin() + offset, out.originY.begin() + offset + count, origin.y);
+    std::fill(out.originZ.begin() + offset, out.originZ.begin() + offset + count, origin.z);
+
+    int i = 0;
+#if defined(RT_SSE)
+    // Matrix4x4::operator* for four directions (x, rowY, 1, 1) at once, summing the terms
+    // in the same order so every lane rounds like the scalar product
+    const float* column = columnX.data() + x0;
+    __m128 dy = _mm_set1_ps(rowY[y]);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 zero = _mm_setzero_ps();
+    auto row = [&](const float* m, __m128 dx) {
+        __m128 sum = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[0]), dx), _mm_mul_ps(_mm_set1_ps(m[1]), dy));
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(m[2]), one));
+        return _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(m[3]), one));
+    };
+    for (; i + 4 <= count; i += 4) {
+        __m128 dx = _mm_loadu_ps(column + i);
+        __m128 resultX = row(view.m[0], dx);
+        __m128 resultY = row(view.m[1], dx);
+        __m128 resultZ = row(view.m[2], dx);
+        __m128 resultW = row(view.m[3], dx);
+        // Lanes with w = 0 keep the undivided value
+        __m128 divide = _mm_cmpneq_ps(resultW, zero);
+        resultX = _mm_or_ps(_mm_and_ps(divide, _mm_div_ps(resultX, resultW)), _mm_andnot_ps(divide, resultX));
+        resultY = _mm_or_ps(_mm_and_ps(divide, _mm_div_ps(resultY, resultW)), _mm_andnot_ps(divide, resultY));
+        resultZ = _mm_or_ps(_mm_and_ps(divide, _mm_div_ps(resultZ, resultW)), _mm_andnot_ps(divide, resultZ));
+        _mm_storeu_ps(outX + i, resultX);
+        _mm_storeu_ps(outY + i, resultY);
+        _mm_storeu_ps(outZ + i, resultZ);
+    }
+#endif
+    for (; i < count; ++i) {
+        Vector3 direction = view * Vector3(columnX[x0 + i], rowY[y], 1.0f);
+        outX[i] = direction.x;
+        outY[i] = direction.y;
+        outZ[i] = direction.z;
+    }
+}
+
+void CameraRayGenerator::generateTile(int x0, int y0, int width, int height, RayBuffer& out) const {
+    out.resize(static_cast<size_t>(width) * height);
+    for (int y = 0; y < height; ++y) {
+        generateRow(y0 + y, x0, width, out, static_cast<size_t>(y) * width);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef RAYGEN_H
+#define RAYGEN_H
+#include <vector>
+#include "base.h"
+
+class Camera;
+
+// Rays stored as structure of arrays, one array per component
+struct RayBuffer {
+    std::vector<float> originX, originY, originZ;
+    std::vector<float> directionX, directionY, directionZ;
+
+    void resize(size_t count);
+    size_t size() const { return originX.size(); }
+    Ray ray(size_t i) const {
+        return Ray(Vector3(originX[i], originY[i], originZ[i]), Vector3(directionX[i], directionY[i], directionZ[i]));
+    }
+};
+
+// Primary rays of one frame's camera. setup() does what Renderer::computeRay repeats for
+// every pixel: the field-of-view tangent, the camera basis, the view matrix and the
+// image-plane coordinate of every column and row. A ray then costs only the product with
+// the view matrix, computed four pixels of a row at a time with SSE. The results match
+// computeRay exactly, including its divide by the w the matrix's last row produces.
+class CameraRayGenerator {
+public:
+    void setup(const Camera& camera);
+
+    Ray ray(int x, int y) const;
+    // Rays of pixels x0 .. x0 + count - 1 of row y, written to out from index offset
+    void generateRow(int y, int x0, int count, RayBuffer& out, size_t offset) const;
+    // Rays of a block of pixels in row-major order, replacing the contents of out
+    void generateTile(int x0, int y0, int width, int height, RayBuffer& out) const;
+
+private:
+    Vector3 origin;
+    Matrix4x4 view;
+    std::vector<float> columnX;  // Image-plane x of each column, scaled by the aspect ratio
+    std::vector<float> rowY;     // Image-plane y of each row
+};
+
+#endif // RAYGEN_H
@@ -3,7 +3,13 @@
 #include <iostream>
 #include <vector>
 #include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include "head.h"
+#include "intersect.h"
+#include "scenecache.h"
+#include "lighttree.h"
 #include "json.hpp"
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -14,6 +20,74 @@ Color operator*(float scalar, const Color& color) {
 Vector3 operator*(float scalar, const Vector3& vec) {
     return vec * scalar; // Utilize the existing Vector3 * float overload
 }
+namespace {
+// Last shape that blocked a shadow ray towards each light, kept per thread. Neighbouring
+// pixels are usually shadowed by the same shape, so testing it first often saves the
+// traversal. Entries are only hints; a stale one just costs one primitive test.
+struct ShadowCache {
+    unsigned long long generation = 0;  // Scene load the cached pointers belong to
+    std::vector<Shape*> lastOccluder;
+    unsigned long long lookups = 0;
+    unsigned long long hits = 0;
+};
+thread_local ShadowCache shadowCache;
+
+// This thread's shadow cache, emptied if it still refers to an older scene
+ShadowCache& currentShadowCache(unsigned long long generation, size_t lightCount) {
+    ShadowCache& cache = shadowCache;
+    if (cache.generation != generation) {
+        cache.generation = generation;
+        cache.lastOccluder.clear();
+    }
+    if (cache.lastOccluder.size() < lightCount) {
+        cache.lastOccluder.resize(lightCount, nullptr);
+    }
+    return cache;
+}
+
+// Shadow ray from a surface point towards a light, and the distance it has to cover
+Ray makeShadowRay(const Vector3& point, const LightSource& light, float& distanceToLight) {
+    Vector3 toLight = light.position - point;
+    distanceToLight = Vector3::length(toLight);
+    Vector3 directionToLight = Vector3::normalize(toLight);
+
+    // Bias to avoid shadow acne
+    const float bias = 1e-4f;
+    Vector3 startPoint = point + directionToLight * bias;
+    return Ray(startPoint, directionToLight);
+}
+
+std::atomic<unsigned long long> nextSceneGeneration(1);
+
+// Primary rays are traced in packets of kPacketSize x kPacketSize pixels
+const int kPacketSize = 8;
+// Rows of pixels whose rays the wavefront renderer keeps in flight at once
+const int kWavefrontRows = 64;
+static_assert(kPacketSize * kPacketSize <= Accelerator::kMaxPacketSize, "packet exceeds accelerator limit");
+
+// Scenes smaller than this build faster than their cache file can be checked and written
+const size_t kMinCachedShapes = 4096;
+
+// Hash of everything the acceleration structure depends on: shapes and meshes, but not
+// the camera, lights or render settings
+uint64_t hashGeometry(const nlohmann::json& json) {
+    uint64_t hash = hashBytes(nullptr, 0);
+    if (!json.contains("scene")) {
+        return hash;
+    }
+    for (const char* key : {"shapes", "meshes"}) {
+        if (!json["scene"].contains(key)) {
+            continue;
+        }
+        for (const auto& entry : json["scene"][key]) {
+            std::string text = entry.dump();
+            hash = hashBytes(text.data(), text.size() + 1, hash);
+        }
+    }
+    return hash;
+}
+}
+
 void Renderer::loadFromJSON(const std::string& filename) {
     // printf("Start loadFromJSON....\n");
     // Open the file and parse the JSON
@@ -25,10 +99,57 @@ void Renderer::loadFromJSON(const std::string& filename) {
     nlohmann::json json;
     file >> json;
 
+    // Shadow caches keyed to an older load must not reuse its shape pointers
+    sceneGeneration = nextSceneGeneration++;
+
     // Load render mode
     if (json.contains("rendermode")) {
         renderMode = json["rendermode"];
     }
+    if (json.contains("wavefront")) {
+        wavefront = json["wavefront"];
+    }
+    if (json.contains("tilemajor")) {
+        tileMajor = json["tilemajor"];
+    }
+    if (json.contains("pixelformat")) {
+        std::string format = json["pixelformat"];
+        if (format == "float") {
+            pixelFormat = Framebuffer::Format::Float;
+        } else if (format == "half") {
+            pixelFormat = Framebuffer::Format::Half;
+        } else if (format == "rgba8") {
+            pixelFormat = Framebuffer::Format::Rgba8;
+        } else {
+            std::cerr << "Error: Unknown pixel format " << format << std::endl;
+        }
+    }
+    if (json.contains("lighterror")) {
+        lightError = json["lighterror"];
+    }
+
+    // Load the acceleration structure type; a different type than last time forces a build
+    if (json.contains("accelerator")) {
+        acceleratorType = json["accelerator"];
+    }
+    if (json.contains("spatialsplitbudget") && json["spatialsplitbudget"].get<float>() != spatialSplitBudget) {
+        spatialSplitBudget = json["spatialsplitbudget"];
+        accelerator.reset();
+    }
+    if (accelerator && acceleratorType != accelerator->name()) {
+        accelerator.reset();
+    }
+    if (!accelerator) {
+        acceleratorBuilt = false;
+        accelerator.reset(createAccelerator(acceleratorType, spatialSplitBudget));
+        if (!accelerator) {
+            std::cerr << "Error: Unknown accelerator " << acceleratorType << ", using bvh" << std::endl;
+            acceleratorType = "bvh";
+            accelerator.reset(createAccelerator(acceleratorType));
+        }
+    }
+
+    bool sameTopology = false;
 
     // Load camera data
     if (json.contains("camera")) {
@@ -58,7 +179,8 @@ void Renderer::loadFromJSON(const std::string& filename) {
     // Load scene data
     if (json.contains("scene")) {
         nlohmann::json sceneJson = json["scene"];
-        // Load light sources
+        // Load light sources, replacing those of a previously loaded frame
+        scene.clearLights();
         if (sceneJson.contains("lightsources")) {
             for (const auto& lightJson : sceneJson["lightsources"]) {
                 LightSource* light = new LightSource();
@@ -67,12 +189,36 @@ void Renderer::loadFromJSON(const std::string& filename) {
                 scene.lights.push_back(light);
             }
         }
+        lightTree.build(scene.lights);
         scene.backgroundColor = {
             sceneJson["backgroundcolor"][0],
             sceneJson["backgroundcolor"][1],
             sceneJson["backgroundcolor"][2]
         };
+        // Load shared meshes; instances reference them by name, so each mesh and its
+        // bottom-level BVH is built once however many times it is placed
+        std::vector<Mesh*> meshes;
+        if (sceneJson.contains("meshes")) {
+            for (const auto& meshJson : sceneJson["meshes"]) {
+                Mesh* mesh = new Mesh();
+                mesh->name = meshJson["name"];
+                const auto& verticesJson = meshJson["vertices"];
+                for (const auto& indexJson : meshJson["indices"]) {
+                    Triangle* triangle = new Triangle();
+                    int i0 = indexJson[0], i1 = indexJson[1], i2 = indexJson[2];
+                    triangle->v0 = { verticesJson[i0][0], verticesJson[i0][1], verticesJson[i0][2] };
+                    triangle->v1 = { verticesJson[i1][0], verticesJson[i1][1], verticesJson[i1][2] };
+                    triangle->v2 = { verticesJson[i2][0], verticesJson[i2][1], verticesJson[i2][2] };
+                    triangle->prepare();
+                    mesh->triangles.push_back(triangle);
+                }
+                mesh->build();
+                meshes.push_back(mesh);
+            }
+        }
+
         // Load shapes
+        std::vector<Shape*> shapes;
         for (const auto& shapeJson : sceneJson["shapes"]) {
             std::string type = shapeJson["type"];
             Material material;
@@ -94,7 +240,7 @@ void Renderer::loadFromJSON(const std::string& filename) {
                 sphere->material = material;
                 sphere->center = { shapeJson["center"][0], shapeJson["center"][1], shapeJson["center"][2] };
                 sphere->radius = shapeJson["radius"];
-                scene.shapes.push_back(sphere);
+                shapes.push_back(sphere);
             } else if (type == "cylinder") {
                 Cylinder* cylinder = new Cylinder();
                 cylinder->material = material;
@@ -103,19 +249,117 @@ void Renderer::loadFromJSON(const std::string& filename) {
                 cylinder->radius = shapeJson["radius"];
                 cylinder->height = shapeJson["height"];
                 cylinder->height *= 2;
-                scene.shapes.push_back(cylinder);
+                shapes.push_back(cylinder);
             } else if (type == "triangle") {
                 Triangle* triangle = new Triangle();
                 triangle->material = material;
                 triangle->v0 = { shapeJson["v0"][0], shapeJson["v0"][1], shapeJson["v0"][2] };
                 triangle->v1 = { shapeJson["v1"][0], shapeJson["v1"][1], shapeJson["v1"][2] };
                 triangle->v2 = { shapeJson["v2"][0], shapeJson["v2"][1], shapeJson["v2"][2] };
-                scene.shapes.push_back(triangle);
+                shapes.push_back(triangle);
+            } else if (type == "instance") {
+                std::string meshName = shapeJson["mesh"];
+                const Mesh* mesh = nullptr;
+                for (const Mesh* candidate : meshes) {
+                    if (candidate->name == meshName) {
+                        mesh = candidate;
+                        break;
+                    }
+                }
+                if (mesh == nullptr) {
+                    std::cerr << "Error: Unknown mesh " << meshName << std::endl;
+                    continue;
+                }
+                Instance* instance = new Instance();
+                instance->material = material;
+                instance->mesh = mesh;
+                if (shapeJson.contains("transform")) {
+                    // Row-major 4x4 object-to-world matrix
+                    Matrix4x4 transform;
+                    for (int i = 0; i < 4; ++i) {
+                        for (int j = 0; j < 4; ++j) {
+                            transform.m[i][j] = shapeJson["transform"][i][j];
+                        }
+                    }
+                    instance->setTransform(transform);
+                }
+                shapes.push_back(instance);
             }
         }
+
+        // Derive the per-primitive data the ray tests read, once per load
+        for (Shape* shape : shapes) {
+            shape->prepare();
+        }
+
+        // When only the shape parameters changed since the previous load (an animation
+        // frame), keep the hierarchy and refit it; rebuild if the refitted tree degraded
+        // past refitThreshold or the scene topology changed
+        sameTopology = updateShapes(shapes) && acceleratorBuilt;
+        scene.setMeshes(meshes);
+    }
+
+    if (sameTopology && accelerator->refit() <= refitThreshold) {
+        return;
+    }
+    // Build the acceleration structure once the shapes are in place, or map it from the
+    // cache an earlier load of the same geometry left next to the scene file
+    bool cacheable = useAcceleratorCache && scene.shapes.size() >= kMinCachedShapes;
+    std::string cachePath = acceleratorCachePath(filename);
+    uint64_t cacheKey = cacheable ? hashBytes(&spatialSplitBudget, sizeof(spatialSplitBudget), hashGeometry(json)) : 0;
+    auto buildStart = std::chrono::steady_clock::now();
+    bool fromCache = cacheable && loadAcceleratorCache(cachePath, cacheKey, *accelerator, scene.shapes);
+    if (!fromCache) {
+        accelerator->build(scene.shapes);
+    }
+    acceleratorBuilt = true;
+    buildMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+    if (!scene.shapes.empty()) {
+        size_t bytes = accelerator->memoryUsage();
+        printf("%s %s over %zu shapes in %.1f ms: %.1f KB, %.1f bytes per primitive\n", fromCache ? "Loaded" : "Built",
+               accelerator->name(), scene.shapes.size(), buildMilliseconds, bytes / 1024.0,
+               static_cast<double>(bytes) / scene.shapes.size());
+    }
+    if (cacheable && !fromCache) {
+        saveAcceleratorCache(cachePath, cacheKey, *accelerator, scene.shapes);
     }
     // printf("Success loadFromJSON!\n");
 }
+
+bool Renderer::updateShapes(const std::vector<Shape*>& shapes) {
+    bool sameTopology = shapes.size() == scene.shapes.size();
+    for (size_t i = 0; sameTopology && i < shapes.size(); ++i) {
+        sameTopology = shapes[i]->type == scene.shapes[i]->type;
+    }
+
+    if (!sameTopology) {
+        for (auto* shape : scene.shapes) {
+            delete shape;
+        }
+        scene.shapes = shapes;
+        return false;
+    }
+
+    // Copy the new parameters into the existing objects so the hierarchy stays valid
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        switch (shapes[i]->type) {
+        case ShapeType::Sphere:
+            *static_cast<Sphere*>(scene.shapes[i]) = *static_cast<Sphere*>(shapes[i]);
+            break;
+        case ShapeType::Cylinder:
+            *static_cast<Cylinder*>(scene.shapes[i]) = *static_cast<Cylinder*>(shapes[i]);
+            break;
+        case ShapeType::Triangle:
+            *static_cast<Triangle*>(scene.shapes[i]) = *static_cast<Triangle*>(shapes[i]);
+            break;
+        case ShapeType::Instance:
+            *static_cast<Instance*>(scene.shapes[i]) = *static_cast<Instance*>(shapes[i]);
+            break;
+        }
+        delete shapes[i];
+    }
+    return true;
+}
 Color blendColor(const Color& originalColor, const Color& reflectedColor, float reflectivity) {
     return (1 - reflectivity) * originalColor + reflectivity * reflectedColor;
 }
@@ -152,218 +396,6 @@ Ray Renderer::computeRay(int x, int y) {
     return Ray(camera.position, transformedDirection);
 }
 
-bool Renderer::intersectBinary(const Ray& ray, Shape* shape) {
-    if (shape->getType() == "sphere") {
-        Sphere* sphere = static_cast<Sphere*>(shape);
-        Vector3 oc = ray.origin - sphere->center;
-        float a = Vector3::dot(ray.direction, ray.direction);
-        float b = 2.0f * Vector3::dot(oc, ray.direction);
-        float c = Vector3::dot(oc, oc) - sphere->radius * sphere->radius;
-        float discriminant = b * b - 4 * a * c;
-        return (discriminant > 0);
-    }
-    else if (shape->getType() == "cylinder") {
-        Cylinder* cylinder = static_cast<Cylinder*>(shape);
-        Vector3 oc = ray.origin - cylinder->center;
-        float a = Vector3::dot(ray.direction, ray.direction) - pow(Vector3::dot(ray.direction, cylinder->axis), 2);
-        float b = 2.0f * (Vector3::dot(oc, ray.direction) - Vector3::dot(ray.direction, cylinder->axis) * Vector3::dot(oc, cylinder->axis));
-        float c = Vector3::dot(oc, oc) - pow(Vector3::dot(oc, cylinder->axis), 2) - cylinder->radius * cylinder->radius;
-        float discriminant = b * b - 4 * a * c;
-
-        // Check intersection with the sides of the cylinder
-        if (discriminant >= 0) {
-            float t1 = (-b - sqrt(discriminant)) / (2.0f * a);
-            float t2 = (-b + sqrt(discriminant)) / (2.0f * a);
-            Vector3 point1 = ray.origin + ray.direction * t1;
-            Vector3 point2 = ray.origin + ray.direction * t2;
-            float heightStart = Vector3::projectAlongAxis(cylinder->getBottomCenter(), cylinder->axis);
-            float heightEnd = Vector3::projectAlongAxis(cylinder->getTopCenter(), cylinder->axis);
-
-            float point1Projection = Vector3::projectAlongAxis(point1, cylinder->axis);
-            float point2Projection = Vector3::projectAlongAxis(point2, cylinder->axis);
-
-            if ((point1Projection >= heightStart && point1Projection <= heightEnd)
-                || (point2Projection >= heightStart && point2Projection <= heightEnd)) {
-                return true;
-            }
-        }
-
-        // Check intersection with the top cap of the cylinder
-        Vector3 topCenter = cylinder->getTopCenter();
-        float tTop = Vector3::dot(topCenter - ray.origin, cylinder->axis) / Vector3::dot(ray.direction, cylinder->axis);
-        if (tTop >= 0) {
-            Vector3 pointOnTopCap = ray.origin + ray.direction * tTop;
-            if (Vector3::lengthSquared(pointOnTopCap - topCenter) <= cylinder->radius * cylinder->radius) {
-                return true;
-            }
-        }
-
-        // Check intersection with the bottom cap of the cylinder
-        Vector3 bottomCenter = cylinder->getBottomCenter();
-        float tBottom = Vector3::dot(bottomCenter - ray.origin, cylinder->axis) / Vector3::dot(ray.direction, cylinder->axis);
-        if (tBottom >= 0) {
-            Vector3 pointOnBottomCap = ray.origin + ray.direction * tBottom;
-            if (Vector3::lengthSquared(pointOnBottomCap - bottomCenter) <= cylinder->radius * cylinder->radius) {
-                return true;
-            }
-        }
-    }
-    else if (shape->getType() == "triangle") {
-        Triangle* triangle = static_cast<Triangle*>(shape);
-        Vector3 edge1 = triangle->v1 - triangle->v0;
-        Vector3 edge2 = triangle->v2 - triangle->v0;
-        Vector3 pvec = Vector3::cross(ray.direction, edge2);
-        float det = Vector3::dot(edge1, pvec);
-        if (fabs(det) < 1e-8) {
-            return false;  // Ray is parallel to the triangle
-        }
-        float invDet = 1.0f / det;
-        Vector3 tvec = ray.origin - triangle->v0;
-        float u = Vector3::dot(tvec, pvec) * invDet;
-        if (u < 0.0f || u > 1.0f) {
-            return false;
-        }
-        Vector3 qvec = Vector3::cross(tvec, edge1);
-        float v = Vector3::dot(ray.direction, qvec) * invDet;
-        if (v < 0.0f || u + v > 1.0f) {
-            return false;
-        }
-        return true;  // Ray intersects the triangle
-    }
-    // TODO: Implement intersection tests for other shape types (cylinder, triangle, etc.)
-    return false;
-}
-
-bool Renderer::intersect(const Ray& ray, Shape* shape, float& distance) {
-    if (shape->getType() == "sphere") {
-        Sphere* sphere = static_cast<Sphere*>(shape);
-        Vector3 oc = ray.origin - sphere->center;
-        float a = Vector3::dot(ray.direction, ray.direction);
-        float b = 2.0f * Vector3::dot(oc, ray.direction);
-        float c = Vector3::dot(oc, oc) - sphere->radius * sphere->radius;
-        float discriminant = b * b - 4 * a * c;
-        if (discriminant > 0) {
-            float sqrtDiscriminant = sqrt(discriminant);
-            float t1 = (-b - sqrtDiscriminant) / (2.0f * a);
-            float t2 = (-b + sqrtDiscriminant) / (2.0f * a);
-
-            // Ensure t1 is the smaller (closer) t value
-            if (t1 > t2) {
-                std::swap(t1, t2);
-            }
-
-            // If t1 is positive, we use it
-            if (t1 > 0) {
-                distance = t1;
-                return true;
-            }
-            
-            // If t1 is negative but t2 is positive, we use t2
-            if (t2 > 0) {
-                distance = t2;
-                return true;
-            }
-        }
-    }
-    else if (shape->getType() == "cylinder") {
-        Cylinder* cylinder = static_cast<Cylinder*>(shape);
-        Vector3 oc = ray.origin - cylinder->center;
-        float a = Vector3::dot(ray.direction, ray.direction) - pow(Vector3::dot(ray.direction, cylinder->axis), 2);
-        float b = 2.0f * (Vector3::dot(oc, ray.direction) - Vector3::dot(ray.direction, cylinder->axis) * Vector3::dot(oc, cylinder->axis));
-        float c = Vector3::dot(oc, oc) - pow(Vector3::dot(oc, cylinder->axis), 2) - cylinder->radius * cylinder->radius;
-        float discriminant = b * b - 4 * a * c;
-                // Check intersection with the sides of the cylinder
-        float minDistance = std::numeric_limits<float>::infinity();  // Initialize with max value
-        bool hasIntersection = false;
-        if (discriminant >= 0) {
-   
-            float t1 = (-b - sqrt(discriminant)) / (2.0f * a);
-            float t2 = (-b + sqrt(discriminant)) / (2.0f * a);
-            // Ensure t1 is the smaller (closer) t value
-            if (t1 > t2) {
-                std::swap(t1, t2);
-            }
-
-            Vector3 point1 = ray.origin + ray.direction * t1;
-            Vector3 point2 = ray.origin + ray.direction * t2;
-            float heightStart = Vector3::projectAlongAxis(cylinder->getBottomCenter(), cylinder->axis);
-            float heightEnd = Vector3::projectAlongAxis(cylinder->getTopCenter(), cylinder->axis);
-
-            float point1Projection = Vector3::projectAlongAxis(point1, cylinder->axis);
-            float point2Projection = Vector3::projectAlongAxis(point2, cylinder->axis);
-            // Check if t1 is within the cylinder height
-            if (t1 > 0 && point1Projection >= heightStart && point1Projection <= heightEnd) {
-                minDistance = std::min(minDistance, t1);
-                hasIntersection = true;
-            }
-            // If t1 is negative, check t2
-            else if (t2 > 0 && point2Projection >= heightStart && point2Projection <= heightEnd) {
-                minDistance = std::min(minDistance, t2);
-                hasIntersection = true;
-            }
-        }
-
-        // Check intersection with the top cap of the cylinder
-        Vector3 topCenter = cylinder->getTopCenter();
-        float tTop = Vector3::dot(topCenter - ray.origin, cylinder->axis) / Vector3::dot(ray.direction, cylinder->axis);
-        if (tTop >= 0) {
-            Vector3 pointOnTopCap = ray.origin + ray.direction * tTop;
-            if (tTop > 0 && Vector3::lengthSquared(pointOnTopCap - topCenter) <= cylinder->radius * cylinder->radius) {
-                minDistance = std::min(minDistance, tTop);
-                hasIntersection = true;
-            }
-        }
-
-        // Check intersection with the bottom cap of the cylinder
-        Vector3 bottomCenter = cylinder->getBottomCenter();
-        float tBottom = Vector3::dot(bottomCenter - ray.origin, cylinder->axis) / Vector3::dot(ray.direction, cylinder->axis);
-        if (tBottom >= 0) {
-            Vector3 pointOnBottomCap = ray.origin + ray.direction * tBottom;
-            if (tBottom > 0 && Vector3::lengthSquared(pointOnBottomCap - bottomCenter) <= cylinder->radius * cylinder->radius) {
-                minDistance = std::min(minDistance, tBottom);
-                hasIntersection = true;
-            }
-        }
-        // After all checks, if an intersection was found, update the distance
-        if (hasIntersection) {
-            distance = minDistance;
-            return true;
-        }
-        // If no intersection is found, return false
-        return false;
-    }
-    else if (shape->getType() == "triangle") {
-        Triangle* triangle = static_cast<Triangle*>(shape);
-        Vector3 edge1 = triangle->v1 - triangle->v0;
-        Vector3 edge2 = triangle->v2 - triangle->v0;
-        Vector3 pvec = Vector3::cross(ray.direction, edge2);
-        float det = Vector3::dot(edge1, pvec);
-        if (fabs(det) < 1e-8) {
-            return false;  // Ray is parallel to the triangle
-        }
-        float invDet = 1.0f / det;
-        Vector3 tvec = ray.origin - triangle->v0;
-        float u = Vector3::dot(tvec, pvec) * invDet;
-        if (u < 0.0f || u > 1.0f) {
-            return false;
-        }
-        Vector3 qvec = Vector3::cross(tvec, edge1);
-        float v = Vector3::dot(ray.direction, qvec) * invDet;
-        if (v < 0.0f || u + v > 1.0f) {
-            return false;
-        }
-        // Compute the distance to the intersection point
-        float minDistance = Vector3::dot(edge2, qvec) * invDet;
-        if (minDistance > 1e-8) { // Check for a positive distance to avoid intersections behind the ray origin
-            distance = minDistance;
-            return true;  // Ray intersects the triangle
-        }
-    }
-    return false;
-
-    // If no intersection is found, return false
-    return false;
-}
 Color calculateLocalIllumination(const Vector3& intersectionPoint, 
                                  const Vector3& normal, 
                                  const Material& material, 
@@ -374,25 +406,12 @@ Color calculateLocalIllumination(const Vector3& intersectionPoint,
     Color diffuse(0.0f, 0.0f, 0.0f);
     Color specular(0.0f, 0.0f, 0.0f);
 
+    float shininess = material.specularExponent;
     for (const auto& lightPtr : lights) {
-        Vector3 lightDir = (lightPtr->position - intersectionPoint).normalize(); // Direction from point to light
-        Vector3 halfVector = (viewDirection + lightDir).normalize(); // Halfway vector between view direction and light direction
-
-        // Diffuse reflection
-        float diff = std::max(Vector3::dot(normal, lightDir), 0.0f);
+        // Diffuse and specular reflection
+        float diff, specCoefficient;
+        blinnPhongTerms(intersectionPoint, normal, viewDirection, shininess, lightPtr->position, diff, specCoefficient);
         diffuse += lightPtr->intensity * (material.diffuseColor * diff);
-
-        // // Specular reflection
-        // float spec = std::pow(std::max(Vector3::dot(normal, halfVector), 0.0f), material.specularExponent);
-        // specular += lightPtr->intensity * (material.specularColor * spec);
-        // Specular reflection
-        float shininess = material.specularExponent;
-        float specCoefficient = std::pow(std::max(Vector3::dot(normal, halfVector), 0.0f), shininess);
-
-        // Reduce the intensity of the specular reflection if it's too strong
-        float specularIntensityReduction = 0.5f; // Value less than 1 to reduce intensity, experiment with this value
-        specCoefficient *= specularIntensityReduction;
-
         specular += lightPtr->intensity * (material.specularColor * specCoefficient);
     }
         
@@ -405,25 +424,57 @@ Color calculateLocalIllumination(const Vector3& intersectionPoint,
     return pixelColor;
 }
 
-bool Renderer::isInShadow(const Vector3& point, const std::vector<Shape*>& shapes, const std::vector<LightSource*>& lights) {
-    for (const auto* light : lights) {
-        Vector3 toLight = light->position - point;
-        float distanceToLight = Vector3::length(toLight);
-        Vector3 directionToLight = Vector3::normalize(toLight);
+bool Renderer::intersectScene(const Ray& ray, Hit& hit) {
+    return accelerator && accelerator->intersect(ray, hit);
+}
+
+void Renderer::intersectScenePacket(const Ray* rays, int count, Hit* hits) {
+    if (accelerator) {
+        accelerator->intersectPacket(rays, count, hits);
+    }
+}
 
-        // Bias to avoid shadow acne
-        const float bias = 1e-4f; 
-        Vector3 startPoint = point + directionToLight * bias;
+bool Renderer::occludedScene(const Ray& ray, float tMax, Shape*& blocker) {
+    return accelerator && accelerator->occluded(ray, tMax, blocker);
+}
 
-        Ray shadowRay(startPoint, directionToLight);
-        
-        for (auto* shape : shapes) {
-            float distance = std::numeric_limits<float>::max();
-            if (intersect(shadowRay, shape, distance)) {
-                if (distance < distanceToLight) {
-                    return true; // The point is in shadow with respect to this light
-                }
-            }
+void Renderer::flushShadowCacheStats() {
+    shadowCacheLookups += shadowCache.lookups;
+    shadowCacheHits += shadowCache.hits;
+    shadowCache.lookups = 0;
+    shadowCache.hits = 0;
+}
+
+const std::vector<LightSource*>& Renderer::shadingLights(const Vector3& point, const Vector3& normal,
+                                                         const Material& material, const Vector3& viewDirection,
+                                                         LightCut& cut, const int*& lightIds) {
+    if (lightError <= 0.0f || lightTree.empty()) {
+        lightIds = nullptr;
+        return scene.lights;
+    }
+    lightTree.selectCut(point, normal, material, viewDirection, lightError, cut);
+    lightIds = cut.indices.data();
+    return cut.pointers;
+}
+
+bool Renderer::isInShadow(const Vector3& point, const std::vector<LightSource*>& lights, const int* lightIds) {
+    ShadowCache& cache = currentShadowCache(sceneGeneration, scene.lights.size());
+
+    for (size_t lightIndex = 0; lightIndex < lights.size(); ++lightIndex) {
+        float distanceToLight;
+        Ray shadowRay = makeShadowRay(point, *lights[lightIndex], distanceToLight);
+
+        // Try the shape that blocked the previous shadow ray towards this light first
+        Shape*& cached = cache.lastOccluder[lightIds ? lightIds[lightIndex] : lightIndex];
+        ++cache.lookups;
+        if (cached != nullptr && occludedPrimitive(shadowRay, cached, distanceToLight)) {
+            ++cache.hits;
+            return true;
+        }
+        Shape* blocker = nullptr;
+        if (occludedScene(shadowRay, distanceToLight, blocker)) {
+            cached = blocker;
+            return true; // The point is in shadow with respect to this light
         }
     }
 
@@ -441,23 +492,22 @@ Color Renderer::calculateReflection(const Ray& incidentRay, const Vector3& inter
     float bias = 1e-4; // A small bias to avoid self-intersection
     Ray reflectedRay(intersectionPoint + bias * normal, reflectedDirection);
 
-    for (auto* shape : scene.shapes) {
-        float distance;
-        if (intersect(reflectedRay, shape, distance)) {
-            Vector3 hitPoint = intersectionPoint + distance * reflectedRay.direction;
-            Vector3 hitNormal = shape->getNormal(hitPoint);
-
-            if (shape->material.isRefractive) {
-                // Handle refraction for transparent objects
-                Color refractedColor = calculateRefraction(reflectedRay, hitPoint, hitNormal, shape->material);
-                return blendColor(refractedColor, calculateLocalIllumination(hitPoint, hitNormal, shape->material, -reflectedDirection, scene.lights), shape->material.reflectivity);
-            } else if (isInShadow(hitPoint, scene.shapes, scene.lights)) {
-                // If in shadow, use a darker color or the shadow color
-                return adjustForShadows(calculateLocalIllumination(hitPoint, hitNormal, shape->material, -reflectedDirection, scene.lights));
-            } else {
-                // If not in shadow, calculate the full illumination
-                return calculateLocalIllumination(hitPoint, hitNormal, shape->material, -reflectedDirection, scene.lights);
-            }
+    Hit hit;
+    if (intersectScene(reflectedRay, hit)) {
+        const Material& hitMaterial = hit.material();
+        Vector3 hitPoint = intersectionPoint + hit.distance * reflectedRay.direction;
+        Vector3 hitNormal = hit.normal(hitPoint);
+
+        if (hitMaterial.isRefractive) {
+            // Handle refraction for transparent objects
+            Color refractedColor = calculateRefraction(reflectedRay, hitPoint, hitNormal, hitMaterial);
+            return blendColor(refractedColor, calculateLocalIllumination(hitPoint, hitNormal, hitMaterial, -reflectedDirection, scene.lights), hitMaterial.reflectivity);
+        } else if (isInShadow(hitPoint, scene.lights)) {
+            // If in shadow, use a darker color or the shadow color
+            return adjustForShadows(calculateLocalIllumination(hitPoint, hitNormal, hitMaterial, -reflectedDirection, scene.lights));
+        } else {
+            // If not in shadow, calculate the full illumination
+            return calculateLocalIllumination(hitPoint, hitNormal, hitMaterial, -reflectedDirection, scene.lights);
         }
     }
 
@@ -476,26 +526,12 @@ float Renderer::clamp(float min, float max, float value) {
 
 Color Renderer::traceRefractedRay(const Ray& refractedRay) {
     // Find the closest shape that the refracted ray intersects
-    Shape* closestShape = nullptr;
-    float closestDistance = std::numeric_limits<float>::max();
-    Vector3 closestIntersectionPoint;
-    Vector3 closestNormal;
-
-    for (Shape* shape : scene.shapes) {
-        float distance;
-        if (intersect(refractedRay, shape, distance)) {
-            if (distance < closestDistance) {
-                closestDistance = distance;
-                closestShape = shape;
-                closestIntersectionPoint = refractedRay.origin + refractedRay.direction * distance;
-                closestNormal = shape->getNormal(closestIntersectionPoint);
-            }
-        }
-    }
-
-    if (closestShape) {
+    Hit hit;
+    if (intersectScene(refractedRay, hit)) {
+        Vector3 closestIntersectionPoint = refractedRay.origin + refractedRay.direction * hit.distance;
+        Vector3 closestNormal = hit.normal(closestIntersectionPoint);
         // Compute the color at the intersection point
-        return calculateLocalIllumination(closestIntersectionPoint, closestNormal, closestShape->material, -refractedRay.direction, scene.lights);
+        return calculateLocalIllumination(closestIntersectionPoint, closestNormal, hit.material(), -refractedRay.direction, scene.lights);
     } else {
         // If the ray does not intersect anything, return the background color
         return scene.backgroundColor;
@@ -537,54 +573,69 @@ Color toneMappingLinear(const Color& hdrColor, float exposure=1.0) {
 
 
 
-void Renderer::writeColorImageToPPM(const std::vector<std::vector<Color>>& image, const std::string& filename) {
+Framebuffer Renderer::createFramebuffer() const {
+    return Framebuffer(camera.width, camera.height,
+                       tileMajor ? Framebuffer::Layout::TileMajor : Framebuffer::Layout::RowMajor, kPacketSize,
+                       pixelFormat);
+}
+
+void Renderer::writeColorImageToPPM(const Framebuffer& image, const std::string& filename) {
     std::ofstream file(filename);
     file << "P6\n" << camera.width << " " << camera.height << "\n255\n";
 
-    for (const auto& row : image) {
-        for (const Color& pixel : row) {
-            unsigned char r, g, b;
-            pixel.getAsIntegers(r, g, b); // Convert float color values to unsigned char
-            file.write(reinterpret_cast<char*>(&r), 1); // Write red component
-            file.write(reinterpret_cast<char*>(&g), 1); // Write green component
-            file.write(reinterpret_cast<char*>(&b), 1); // Write blue component
-        }
+    std::vector<unsigned char> bytes(3 * static_cast<size_t>(image.width()));
+    for (int y = 0; y < image.height(); ++y) {
+        image.quantizeRow(y, bytes.data());
+        file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
     }
 }
 
 
-std::vector<std::vector<Color>> Renderer::render(){
+Framebuffer Renderer::render(){
     printf("Start render....\n");
+    auto renderStart = std::chrono::steady_clock::now();
+    Framebuffer image;
+    rayGenerator.setup(camera);
     if (renderMode == "phong"){
-        return renderPhong();
+        // Cache statistics cover this frame only
+        shadowCacheLookups = 0;
+        shadowCacheHits = 0;
+        image = wavefront ? renderPhongWavefront() : renderPhong();
+        flushShadowCacheStats();
+        if (shadowCacheLookups > 0) {
+            printf("Shadow cache: %llu of %llu lookups hit (%.1f%%)\n", shadowCacheHits.load(), shadowCacheLookups.load(),
+                   100.0 * shadowCacheHits.load() / shadowCacheLookups.load());
+        }
     }
     else if (renderMode == "binary"){
-        return renderBinary();
+        image = renderBinary();
     }
     else{
         std::cerr << "Error: Unknown render mode " << renderMode << std::endl;
-        return std::vector<std::vector<Color>>();
+        return Framebuffer();
     }
-    return std::vector<std::vector<Color>>();
+    renderMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - renderStart).count();
+    // Build time is reported by loadFromJSON, so this covers ray tracing only
+    printf("Rendered in %.1f ms\n", renderMilliseconds);
+    return image;
 }
 
-std::vector<std::vector<Color>> Renderer::renderBinary() {
-    std::vector<std::vector<Color>> image(camera.height, std::vector<Color>(camera.width));
+Framebuffer Renderer::renderBinary() {
+    Framebuffer image = createFramebuffer();
+    RayBuffer row;
+    row.resize(camera.width);
 
     for (int y = 0; y < camera.height; ++y) {
+        rayGenerator.generateRow(y, 0, camera.width, row, 0);
         for (int x = 0; x < camera.width; ++x) {
-            Ray ray = computeRay(x, y);
-            bool hit = false;
-            for (Shape* shape : scene.shapes) {
-                if (intersectBinary(ray, shape)) {
-                    // Red color for intersection (assuming float range 0.0 to 1.0)
-                    image[y][x] = {1.0f, 0.0f, 0.0f};  
-                    hit = true;
-                    break;
-                }
+            Ray ray = row.ray(x);
+            Shape* blocker = nullptr;
+            if (occludedScene(ray, std::numeric_limits<float>::max(), blocker)) {
+                // Red color for intersection (assuming float range 0.0 to 1.0)
+                image.set(x, y, Color(1.0f, 0.0f, 0.0f));
             }
-            if (!hit) {  // No intersection, use background color
-                image[y][x] = scene.backgroundColor; // Directly use background color
+            else {  // No intersection, use background color
+                image.set(x, y, scene.backgroundColor); // Directly use background color
             }
         }
     }
@@ -592,69 +643,229 @@ std::vector<std::vector<Color>> Renderer::renderBinary() {
 }
 
 
-std::vector<std::vector<Color>> Renderer::renderPhong() {
-    std::vector<std::vector<Color>> image(camera.height, std::vector<Color>(camera.width));
-    
-    // Iterate over each pixel
-    for (int y = 0; y < camera.height; ++y) {
-        for (int x = 0; x < camera.width; ++x) {
-            Ray ray = computeRay(x, y); // Compute the ray for the current pixel
-            Color pixelColor = scene.backgroundColor; // Start with the background color
-
-            // Intersection test
-            float minDistance = std::numeric_limits<float>::max();
-            Shape* closestShape = nullptr;
-            for (Shape* shape : scene.shapes) {
-                float distance = std::numeric_limits<float>::max(); // Initialize distance to max value
-                if (intersect(ray, shape, distance) && distance < minDistance) {
-                    minDistance = distance;
-                    closestShape = shape;
+Framebuffer Renderer::renderPhong() {
+    Framebuffer image = createFramebuffer();
+    std::vector<Ray> rays;
+    rays.reserve(kPacketSize * kPacketSize);
+    RayBuffer tile;
+    Hit hits[kPacketSize * kPacketSize];
+    LightCut cut;
+
+    // Iterate over the image in square pixel blocks, tracing each block's primary rays
+    // as one packet, then shade each pixel
+    for (int tileY = 0; tileY < camera.height; tileY += kPacketSize) {
+        for (int tileX = 0; tileX < camera.width; tileX += kPacketSize) {
+            int endY = std::min(tileY + kPacketSize, camera.height);
+            int endX = std::min(tileX + kPacketSize, camera.width);
+            // The block is one framebuffer tile, contiguous in the tile-major layout
+            Framebuffer::View pixels = image.tile(tileX / kPacketSize, tileY / kPacketSize);
+            rayGenerator.generateTile(tileX, tileY, endX - tileX, endY - tileY, tile);
+            rays.clear();
+            for (size_t i = 0; i < tile.size(); ++i) {
+                rays.push_back(tile.ray(i));
+                hits[i] = Hit();
+            }
+            intersectScenePacket(rays.data(), static_cast<int>(rays.size()), hits);
+
+            for (int y = tileY; y < endY; ++y) {
+                for (int x = tileX; x < endX; ++x) {
+                    int index = (y - tileY) * (endX - tileX) + (x - tileX);
+                    const Ray& ray = rays[index];
+                    Color pixelColor = scene.backgroundColor; // Start with the background color
+
+                    // Intersection test, already done for the whole block
+                    const Hit& hit = hits[index];
+                    float minDistance = hit.distance;
+                    // If a shape is hit by the ray
+                    if (hit.shape != nullptr) {
+                        // Calculate intersection point and normal
+                        Vector3 intersectionPoint = ray.origin + ray.direction * minDistance;
+                        Vector3 normal = hit.normal(intersectionPoint);
+
+                        // Calculate local illumination (Blinn-Phong)
+                        const int* lightIds;
+                        const std::vector<LightSource*>& lights =
+                            shadingLights(intersectionPoint, normal, hit.material(), ray.direction, cut, lightIds);
+                        pixelColor = calculateLocalIllumination(intersectionPoint, normal, hit.material(), ray.direction, lights);
+                        // Shadows - check if the intersection point is in shadow
+                        // (Optional: Could be optimized with shadow rays)
+                        if (isInShadow(intersectionPoint, lights, lightIds)) {
+                            pixelColor = adjustForShadows(pixelColor);
+                        }
+
+                        // // Reflection
+                        // if (hit.material().isReflective) {
+                        //     Color reflectedColor = calculateReflection(ray, intersectionPoint, normal, hit.material());
+                        //     pixelColor = blendColor(pixelColor, reflectedColor, hit.material().reflectivity);
+                        // }
+
+                        // // Refraction
+                        // if (hit.material().isRefractive) {
+                        //     Color refractedColor = calculateRefraction(ray, intersectionPoint, normal, hit.material());
+                        //     pixelColor = blendColor(pixelColor, refractedColor, 1);
+                        // }
+
+                        // // Textures
+                        // if (hit.shape->hasTexture()) {
+                        //     Color textureColor = getTextureColor(intersectionPoint, hit.shape);
+                        //     pixelColor = blendTextureColor(pixelColor, textureColor);
+                        // }
+
+                        // Tone mapping - linear
+                        pixelColor = toneMappingLinear(pixelColor);
+                    }
+            
+                    // Set the color of the pixel in the image
+                    pixels.set(x - tileX, y - tileY, pixelColor);
                 }
             }
-            // If a shape is hit by the ray
-            if (closestShape != nullptr) {
-                // Calculate intersection point and normal
-                Vector3 intersectionPoint = ray.origin + ray.direction * minDistance;
-                Vector3 normal = closestShape->getNormal(intersectionPoint);
-
-                // Calculate local illumination (Blinn-Phong)
-                pixelColor = calculateLocalIllumination(intersectionPoint, normal, closestShape->material, ray.direction, scene.lights);
-                // Shadows - check if the intersection point is in shadow
-                // (Optional: Could be optimized with shadow rays)
-                if (isInShadow(intersectionPoint, scene.shapes, scene.lights)) {
-                    pixelColor = adjustForShadows(pixelColor);
+        }
+    }
+    return image;
+}
+
+Framebuffer Renderer::renderPhongWavefront() {
+    Framebuffer image = createFramebuffer();
+    image.fill(scene.backgroundColor);
+
+    // A surface point waiting for its shadow rays
+    struct ShadingPoint {
+        Vector3 position;
+        Color color;  // Local illumination, darkened at the end if any light is blocked
+        int x, y;
+        bool shadowed;
+        // Range of the point's lights in cutLights, or firstLight -1 for the scene's lights
+        int firstLight, lightCount;
+    };
+    std::vector<Ray> rays;
+    RayBuffer tile;
+    std::vector<Hit> hits;
+    std::vector<ShadingPoint> points;
+    std::vector<std::pair<uint32_t, int>> order;
+    std::vector<int> pending;
+    std::vector<Ray> shadowRays;
+    std::vector<float> shadowDistances;
+    std::vector<int> batch;
+    std::vector<Shape*> blockers;
+    LightCut cut;
+    std::vector<LightSource> cutLights;
+
+    // The image is processed in bands of rows; each band is one wavefront per stage
+    for (int bandY = 0; bandY < camera.height; bandY += kWavefrontRows) {
+        int bandEnd = std::min(bandY + kWavefrontRows, camera.height);
+
+        // Primary rays, traced as packets of pixel blocks
+        rays.clear();
+        std::vector<std::pair<int, int>> pixels;
+        for (int tileX = 0; tileX < camera.width; tileX += kPacketSize) {
+            for (int tileY = bandY; tileY < bandEnd; tileY += kPacketSize) {
+                int endY = std::min(tileY + kPacketSize, bandEnd);
+                int endX = std::min(tileX + kPacketSize, camera.width);
+                rayGenerator.generateTile(tileX, tileY, endX - tileX, endY - tileY, tile);
+                for (size_t i = 0; i < tile.size(); ++i) {
+                    rays.push_back(tile.ray(i));
+                }
+                for (int y = tileY; y < endY; ++y) {
+                    for (int x = tileX; x < endX; ++x) {
+                        pixels.push_back({x, y});
+                    }
                 }
+            }
+        }
+        hits.assign(rays.size(), Hit());
+        for (size_t first = 0; first < rays.size(); first += kPacketSize * kPacketSize) {
+            int count = static_cast<int>(std::min<size_t>(kPacketSize * kPacketSize, rays.size() - first));
+            intersectScenePacket(&rays[first], count, &hits[first]);
+        }
 
-                // // Reflection
-                // if (closestShape->material.isReflective) {
-                //     Color reflectedColor = calculateReflection(ray, intersectionPoint, normal, closestShape->material);
-                //     pixelColor = blendColor(pixelColor, reflectedColor, closestShape->material.reflectivity);
-                // }
-
-                // // Refraction
-                // if (closestShape->material.isRefractive) {
-                //     Color refractedColor = calculateRefraction(ray, intersectionPoint, normal, closestShape->material);
-                //     pixelColor = blendColor(pixelColor, refractedColor, 1);
-                // }
-
-                // // Textures
-                // if (closestShape->hasTexture()) {
-                //     Color textureColor = getTextureColor(intersectionPoint, closestShape);
-                //     pixelColor = blendTextureColor(pixelColor, textureColor);
-                // }
-
-                // Tone mapping - linear
-                pixelColor = toneMappingLinear(pixelColor);
+        // Local shading of every hit
+        points.clear();
+        cutLights.clear();
+        for (size_t i = 0; i < rays.size(); ++i) {
+            const Hit& hit = hits[i];
+            if (hit.shape == nullptr) {
+                continue;
             }
-            
-            // Set the color of the pixel in the image
-            image[y][x] = pixelColor;
+            ShadingPoint point;
+            point.position = rays[i].origin + rays[i].direction * hit.distance;
+            Vector3 normal = hit.normal(point.position);
+            const int* lightIds;
+            const std::vector<LightSource*>& lights =
+                shadingLights(point.position, normal, hit.material(), rays[i].direction, cut, lightIds);
+            point.color = calculateLocalIllumination(point.position, normal, hit.material(), rays[i].direction, lights);
+            point.firstLight = -1;
+            point.lightCount = static_cast<int>(lights.size());
+            if (lightIds) {
+                point.firstLight = static_cast<int>(cutLights.size());
+                cutLights.insert(cutLights.end(), cut.lights.begin(), cut.lights.end());
+            }
+            point.x = pixels[i].first;
+            point.y = pixels[i].second;
+            point.shadowed = false;
+            points.push_back(point);
+        }
 
-            // Bounding volume hierarchy (BVH) and other acceleration structures can be integrated into the intersection tests
-            // to speed up the rendering process. This is a more advanced topic and would significantly alter the structure of your code.
+        // Shadow rays, one wave per light slot in Morton order of their origins so that
+        // consecutive rays take similar paths through the accelerator. As in isInShadow,
+        // a point blocked from one light casts no rays towards the next. The shadow cache
+        // isInShadow uses is skipped: a wave's blockers are only known once the whole wave
+        // is traced, so none of its rays could reuse them.
+        AABB pointBounds;
+        for (const ShadingPoint& point : points) {
+            pointBounds.expand(point.position);
+        }
+        Vector3 extent = pointBounds.extent();
+        Vector3 scale(extent.x > 0.0f ? 1.0f / extent.x : 0.0f, extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+                      extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+        order.clear();
+        for (size_t i = 0; i < points.size(); ++i) {
+            Vector3 offset = points[i].position - pointBounds.min;
+            Vector3 unit(offset.x * scale.x, offset.y * scale.y, offset.z * scale.z);
+            order.push_back({mortonCode(unit), static_cast<int>(i)});
+        }
+        std::sort(order.begin(), order.end());
+        pending.clear();
+        for (const auto& entry : order) {
+            pending.push_back(entry.second);
+        }
+
+        for (int slot = 0; !pending.empty(); ++slot) {
+            shadowRays.clear();
+            shadowDistances.clear();
+            batch.clear();
+            for (int index : pending) {
+                const ShadingPoint& point = points[index];
+                if (slot >= point.lightCount) {
+                    continue; // Lit by all of its lights
+                }
+                const LightSource& light =
+                    point.firstLight < 0 ? *scene.lights[slot] : cutLights[point.firstLight + slot];
+                float distanceToLight;
+                shadowRays.push_back(makeShadowRay(point.position, light, distanceToLight));
+                shadowDistances.push_back(distanceToLight);
+                batch.push_back(index);
+            }
+            blockers.assign(batch.size(), nullptr);
+            if (accelerator && !batch.empty()) {
+                accelerator->occludedBatch(shadowRays.data(), shadowDistances.data(), static_cast<int>(batch.size()),
+                                           blockers.data());
+            }
+            pending.clear();
+            for (size_t i = 0; i < batch.size(); ++i) {
+                if (blockers[i] != nullptr) {
+                    points[batch[i]].shadowed = true;
+                } else {
+                    pending.push_back(batch[i]);
+                }
+            }
         }
-    }
 
+        // Final shading
+        for (const ShadingPoint& point : points) {
+            Color pixelColor = point.shadowed ? adjustForShadows(point.color) : point.color;
+            image.set(point.x, point.y, toneMappingLinear(pixelColor));
+        }
+    }
     return image;
 }
 
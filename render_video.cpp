@@ -8,8 +8,9 @@ int main() {
     // 总帧数
     int total_frames = 240;
 
+    // 复用同一个渲染器，形状拓扑不变时只重新拟合BVH而不是重建
+    Renderer renderer;
     for (int frame = 0; frame < total_frames; ++frame) {
-        Renderer renderer;
         std::cout<<"processing frame "<<frame<<std::endl;
         // 构建文件名，如 "data/animation_frames/frame_0001.json"
         std::stringstream ss;
@@ -0,0 +1,192 @@
+#include <cstdio>
+#include <fstream>
+#include <unordered_map>
+#include "scenecache.h"
+#include "accel.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+// Bump kVersion whenever a node layout or the payload of any accelerator changes
+const char kMagic[8] = {'R', 'T', 'A', 'C', 'C', 'E', 'L', '\0'};
+const uint32_t kVersion = 2;
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t shapeCount;
+    uint64_t key;
+    char accelerator[16];
+    uint32_t vectorSize;  // sizeof(Vector3), which the RT_SIMD_VECTORS build changes
+};
+}
+
+uint64_t hashBytes(const void* data, size_t size, uint64_t seed) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+bool MappedFile::open(const std::string& path) {
+    close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    const void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (!view) {
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+        return false;
+    }
+    fileHandle = file;
+    mappingHandle = mapping;
+    bytes = static_cast<const char*>(view);
+    length = static_cast<size_t>(fileSize.QuadPart);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    void* view = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if (view == MAP_FAILED) {
+        return false;
+    }
+    bytes = static_cast<const char*>(view);
+    length = static_cast<size_t>(info.st_size);
+#endif
+    return true;
+}
+
+void MappedFile::close() {
+    if (!bytes) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(bytes);
+    CloseHandle(mappingHandle);
+    CloseHandle(fileHandle);
+    fileHandle = mappingHandle = nullptr;
+#else
+    munmap(const_cast<char*>(bytes), length);
+#endif
+    bytes = nullptr;
+    length = 0;
+}
+
+void CacheWriter::writeShapes(const std::vector<Shape*>& primitives, const std::vector<Shape*>& sceneShapes) {
+    std::unordered_map<const Shape*, uint32_t> indexOf;
+    indexOf.reserve(sceneShapes.size());
+    for (size_t i = 0; i < sceneShapes.size(); ++i) {
+        indexOf[sceneShapes[i]] = static_cast<uint32_t>(i);
+    }
+    std::vector<uint32_t> indices(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i) {
+        indices[i] = indexOf[primitives[i]];
+    }
+    write(indices);
+}
+
+bool CacheReader::readShapes(std::vector<Shape*>& primitives, const std::vector<Shape*>& sceneShapes) {
+    std::vector<uint32_t> indices;
+    if (!read(indices)) {
+        return false;
+    }
+    primitives.resize(indices.size());
+    for (size_t i = 0; i < indices.size(); ++i) {
+        if (indices[i] >= sceneShapes.size()) {
+            return false;
+        }
+        primitives[i] = sceneShapes[indices[i]];
+    }
+    return true;
+}
+
+std::string acceleratorCachePath(const std::string& scenePath) {
+    return scenePath + ".accel";
+}
+
+bool saveAcceleratorCache(const std::string& path, uint64_t key, const Accelerator& accelerator,
+                          const std::vector<Shape*>& shapes) {
+    CacheHeader header = {};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.shapeCount = static_cast<uint32_t>(shapes.size());
+    header.key = key;
+    header.vectorSize = sizeof(Vector3);
+    std::strncpy(header.accelerator, accelerator.name(), sizeof(header.accelerator) - 1);
+
+    CacheWriter writer;
+    writer.write(header);
+    if (!accelerator.saveCache(writer, shapes)) {
+        return false;
+    }
+
+    // Write to a temporary file first so a reader never maps a half-written cache
+    std::string temporaryPath = path + ".tmp";
+    {
+        std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            return false;
+        }
+        file.write(writer.data().data(), writer.data().size());
+        if (!file) {
+            file.close();
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
+    }
+    std::remove(path.c_str());
+    return std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+}
+
+bool loadAcceleratorCache(const std::string& path, uint64_t key, Accelerator& accelerator,
+                          const std::vector<Shape*>& shapes) {
+    MappedFile file;
+    if (!file.open(path)) {
+        return false;
+    }
+    CacheReader reader(file.data(), file.size());
+    CacheHeader header;
+    if (!reader.read(header) || std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+        header.version != kVersion || header.key != key || header.shapeCount != shapes.size() ||
+        header.vectorSize != sizeof(Vector3) ||
+        std::strncmp(header.accelerator, accelerator.name(), sizeof(header.accelerator)) != 0) {
+        return false;
+    }
+    if (!accelerator.loadCache(reader, shapes) || !reader.atEnd()) {
+        // Leave no half-loaded structure behind
+        accelerator.build(std::vector<Shape*>());
+        return false;
+    }
+    return true;
+}
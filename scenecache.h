@@ -0,0 +1,112 @@
+#ifndef SCENECACHE_H
+#define SCENECACHE_H
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "base.h"
+
+class Accelerator;
+
+// On-disk cache of built acceleration structures. A cache file sits next to the scene
+// JSON (scene.json -> scene.json.accel) and is keyed by a hash of the scene geometry and
+// the accelerator type, so re-rendering the same scene with another camera or other
+// render settings maps the stored hierarchy instead of building it again.
+
+// FNV-1a over a byte range; pass the previous result as seed to hash several ranges
+uint64_t hashBytes(const void* data, size_t size, uint64_t seed = 14695981039346656037ull);
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+    MappedFile() {}
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    void* fileHandle = nullptr;
+    void* mappingHandle = nullptr;
+#endif
+};
+
+// Appends plain-old-data values to a byte buffer
+class CacheWriter {
+public:
+    template <typename T>
+    void write(const T* values, size_t count) {
+        const char* begin = reinterpret_cast<const char*>(values);
+        buffer.insert(buffer.end(), begin, begin + count * sizeof(T));
+    }
+    template <typename T>
+    void write(const T& value) {
+        write(&value, 1);
+    }
+    template <typename T>
+    void write(const std::vector<T>& values) {
+        write(static_cast<uint64_t>(values.size()));
+        write(values.data(), values.size());
+    }
+    // Shapes are stored as their position in the scene's shape list
+    void writeShapes(const std::vector<Shape*>& primitives, const std::vector<Shape*>& sceneShapes);
+
+    const std::vector<char>& data() const { return buffer; }
+
+private:
+    std::vector<char> buffer;
+};
+
+// Reads values back from a mapped cache; every read fails instead of running past the end
+class CacheReader {
+public:
+    CacheReader(const char* data, size_t size) : bytes(data), length(size) {}
+
+    template <typename T>
+    bool read(T* values, size_t count) {
+        if (count > (length - offset) / sizeof(T)) {
+            return false;
+        }
+        std::memcpy(values, bytes + offset, count * sizeof(T));
+        offset += count * sizeof(T);
+        return true;
+    }
+    template <typename T>
+    bool read(T& value) {
+        return read(&value, 1);
+    }
+    template <typename T>
+    bool read(std::vector<T>& values) {
+        uint64_t count;
+        if (!read(count) || count > (length - offset) / sizeof(T)) {
+            return false;
+        }
+        values.resize(count);
+        return read(values.data(), values.size());
+    }
+    bool readShapes(std::vector<Shape*>& primitives, const std::vector<Shape*>& sceneShapes);
+
+    bool atEnd() const { return offset == length; }
+
+private:
+    const char* bytes;
+    size_t length;
+    size_t offset = 0;
+};
+
+std::string acceleratorCachePath(const std::string& scenePath);
+// Both return false when the accelerator type does not support caching; loading also
+// fails for a missing or corrupt file or one written for a different key
+bool saveAcceleratorCache(const std::string& path, uint64_t key, const Accelerator& accelerator,
+                          const std::vector<Shape*>& shapes);
+bool loadAcceleratorCache(const std::string& path, uint64_t key, Accelerator& accelerator,
+                          const std::vector<Shape*>& shapes);
+
+#endif // SCENECACHE_H
@@ -0,0 +1,354 @@
+#include "shapepool.h"
+#include "intersect.h"
+#include "instance.h"
+
+namespace {
+size_t blockCount(size_t count) {
+    return (count + kBlockSize - 1) / kBlockSize;
+}
+
+// Lanes of a block holding real shapes, given how many remain from its first lane on
+int laneMask(size_t remaining) {
+    return remaining >= static_cast<size_t>(kBlockSize) ? (1 << kBlockSize) - 1 : (1 << remaining) - 1;
+}
+
+bool takeNearest(int mask, const float* distances, Shape* const* shapes, Hit& hit) {
+    bool found = false;
+    for (int lane = 0; lane < kBlockSize; ++lane) {
+        if ((mask & (1 << lane)) && distances[lane] < hit.distance) {
+            hit.distance = distances[lane];
+            hit.shape = shapes[lane];
+            hit.instance = nullptr;
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool takeFirst(int mask, const float* distances, float tMax, Shape* const* shapes, Shape*& blocker) {
+    for (int lane = 0; lane < kBlockSize; ++lane) {
+        if ((mask & (1 << lane)) && distances[lane] < tMax) {
+            blocker = shapes[lane];
+            return true;
+        }
+    }
+    return false;
+}
+}
+
+void ShapePool::clear() {
+    spheres = Spheres();
+    cylinders = Cylinders();
+    triangles = Triangles();
+    instances.clear();
+    primitiveIds.clear();
+}
+
+void ShapePool::build(const std::vector<Shape*>& shapes) {
+    clear();
+    primitiveIds.reserve(shapes.size());
+    for (Shape* shape : shapes) {
+        uint32_t index = 0;
+        switch (shape->type) {
+        case ShapeType::Sphere:
+            index = static_cast<uint32_t>(spheres.shapes.size());
+            spheres.shapes.push_back(shape);
+            break;
+        case ShapeType::Cylinder:
+            index = static_cast<uint32_t>(cylinders.shapes.size());
+            cylinders.shapes.push_back(shape);
+            break;
+        case ShapeType::Triangle:
+            index = static_cast<uint32_t>(triangles.shapes.size());
+            triangles.shapes.push_back(shape);
+            break;
+        case ShapeType::Instance:
+            index = static_cast<uint32_t>(instances.size());
+            instances.push_back(shape);
+            break;
+        }
+        primitiveIds.push_back(makePrimitiveId(shape->type, index));
+    }
+
+    // Sphere and triangle arrays are padded to whole blocks for the block kernels
+    size_t sphereSlots = blockCount(spheres.shapes.size()) * kBlockSize;
+    size_t triangleSlots = blockCount(triangles.shapes.size()) * kBlockSize;
+    spheres.centerX.resize(sphereSlots);
+    spheres.centerY.resize(sphereSlots);
+    spheres.centerZ.resize(sphereSlots);
+    spheres.radiusSquared.resize(sphereSlots);
+    cylinders.centerX.resize(cylinders.shapes.size());
+    cylinders.centerY.resize(cylinders.shapes.size());
+    cylinders.centerZ.resize(cylinders.shapes.size());
+    cylinders.frames.resize(cylinders.shapes.size());
+    for (std::vector<float>* component : {&triangles.v0x, &triangles.v0y, &triangles.v0z, &triangles.edge1x,
+                                          &triangles.edge1y, &triangles.edge1z, &triangles.edge2x, &triangles.edge2y,
+                                          &triangles.edge2z}) {
+        component->resize(triangleSlots);
+    }
+    update();
+}
+
+void ShapePool::update() {
+    for (size_t i = 0; i < spheres.shapes.size(); ++i) {
+        store(makePrimitiveId(ShapeType::Sphere, static_cast<uint32_t>(i)), spheres.shapes[i]);
+    }
+    for (size_t i = 0; i < cylinders.shapes.size(); ++i) {
+        store(makePrimitiveId(ShapeType::Cylinder, static_cast<uint32_t>(i)), cylinders.shapes[i]);
+    }
+    for (size_t i = 0; i < triangles.shapes.size(); ++i) {
+        store(makePrimitiveId(ShapeType::Triangle, static_cast<uint32_t>(i)), triangles.shapes[i]);
+    }
+}
+
+void ShapePool::store(PrimitiveId id, const Shape* shape) {
+    uint32_t i = primitiveIndex(id);
+    switch (primitiveType(id)) {
+    case ShapeType::Sphere: {
+        const Sphere* sphere = static_cast<const Sphere*>(shape);
+        spheres.centerX[i] = sphere->center.x;
+        spheres.centerY[i] = sphere->center.y;
+        spheres.centerZ[i] = sphere->center.z;
+        spheres.radiusSquared[i] = sphere->radiusSquared;
+        break;
+    }
+    case ShapeType::Cylinder: {
+        const Cylinder* cylinder = static_cast<const Cylinder*>(shape);
+        cylinders.centerX[i] = cylinder->center.x;
+        cylinders.centerY[i] = cylinder->center.y;
+        cylinders.centerZ[i] = cylinder->center.z;
+        cylinders.frames[i] = cylinder->frame;
+        break;
+    }
+    case ShapeType::Triangle: {
+        const Triangle* triangle = static_cast<const Triangle*>(shape);
+        triangles.v0x[i] = triangle->v0.x;
+        triangles.v0y[i] = triangle->v0.y;
+        triangles.v0z[i] = triangle->v0.z;
+        triangles.edge1x[i] = triangle->edge1.x;
+        triangles.edge1y[i] = triangle->edge1.y;
+        triangles.edge1z[i] = triangle->edge1.z;
+        triangles.edge2x[i] = triangle->edge2.x;
+        triangles.edge2y[i] = triangle->edge2.y;
+        triangles.edge2z[i] = triangle->edge2.z;
+        break;
+    }
+    case ShapeType::Instance:
+        break;
+    }
+}
+
+Shape* ShapePool::shape(PrimitiveId id) const {
+    uint32_t i = primitiveIndex(id);
+    switch (primitiveType(id)) {
+    case ShapeType::Sphere:
+        return spheres.shapes[i];
+    case ShapeType::Cylinder:
+        return cylinders.shapes[i];
+    case ShapeType::Triangle:
+        return triangles.shapes[i];
+    case ShapeType::Instance:
+        return instances[i];
+    }
+    return nullptr;
+}
+
+size_t ShapePool::memoryUsage() const {
+    return spheres.centerX.size() * 4 * sizeof(float) + spheres.shapes.size() * sizeof(Shape*) +
+           cylinders.shapes.size() * (3 * sizeof(float) + sizeof(CylinderFrame) + sizeof(Shape*)) +
+           triangles.v0x.size() * 9 * sizeof(float) + triangles.shapes.size() * sizeof(Shape*) +
+           instances.size() * sizeof(Shape*) +
+           primitiveIds.size() * sizeof(PrimitiveId);
+}
+
+template <>
+bool ShapePool::intersectOne<ShapeType::Sphere>(const Ray& ray, uint32_t i, float& distance) const {
+    return intersectSphere(ray, Vector3(spheres.centerX[i], spheres.centerY[i], spheres.centerZ[i]),
+                           spheres.radiusSquared[i], distance);
+}
+
+template <>
+bool ShapePool::intersectOne<ShapeType::Cylinder>(const Ray& ray, uint32_t i, float& distance) const {
+    return intersectCylinder(ray, Vector3(cylinders.centerX[i], cylinders.centerY[i], cylinders.centerZ[i]),
+                             cylinders.frames[i], distance);
+}
+
+template <>
+bool ShapePool::intersectOne<ShapeType::Triangle>(const Ray& ray, uint32_t i, float& distance) const {
+    return intersectTriangle(ray, Vector3(triangles.v0x[i], triangles.v0y[i], triangles.v0z[i]),
+                             Vector3(triangles.edge1x[i], triangles.edge1y[i], triangles.edge1z[i]),
+                             Vector3(triangles.edge2x[i], triangles.edge2y[i], triangles.edge2z[i]), distance);
+}
+
+template <>
+bool ShapePool::occludedOne<ShapeType::Sphere>(const Ray& ray, uint32_t i, float tMax) const {
+    return occludeSphere(ray, Vector3(spheres.centerX[i], spheres.centerY[i], spheres.centerZ[i]),
+                         spheres.radiusSquared[i], tMax);
+}
+
+template <>
+bool ShapePool::occludedOne<ShapeType::Cylinder>(const Ray& ray, uint32_t i, float tMax) const {
+    return occludeCylinder(ray, Vector3(cylinders.centerX[i], cylinders.centerY[i], cylinders.centerZ[i]),
+                           cylinders.frames[i], tMax);
+}
+
+template <>
+bool ShapePool::occludedOne<ShapeType::Triangle>(const Ray& ray, uint32_t i, float tMax) const {
+    return occludeTriangle(ray, Vector3(triangles.v0x[i], triangles.v0y[i], triangles.v0z[i]),
+                           Vector3(triangles.edge1x[i], triangles.edge1y[i], triangles.edge1z[i]),
+                           Vector3(triangles.edge2x[i], triangles.edge2y[i], triangles.edge2z[i]), tMax);
+}
+
+bool ShapePool::intersect(const Ray& ray, PrimitiveId id, Hit& hit) const {
+    uint32_t i = primitiveIndex(id);
+    float distance;
+    bool found = false;
+    switch (primitiveType(id)) {
+    case ShapeType::Sphere:
+        found = intersectOne<ShapeType::Sphere>(ray, i, distance);
+        break;
+    case ShapeType::Cylinder:
+        found = intersectOne<ShapeType::Cylinder>(ray, i, distance);
+        break;
+    case ShapeType::Triangle:
+        found = intersectOne<ShapeType::Triangle>(ray, i, distance);
+        break;
+    case ShapeType::Instance:
+        return static_cast<const Instance*>(instances[i])->intersect(ray, hit);
+    }
+    if (found && distance < hit.distance) {
+        hit.distance = distance;
+        hit.shape = shape(id);
+        hit.instance = nullptr;
+        return true;
+    }
+    return false;
+}
+
+bool ShapePool::occluded(const Ray& ray, PrimitiveId id, float tMax) const {
+    uint32_t i = primitiveIndex(id);
+    switch (primitiveType(id)) {
+    case ShapeType::Sphere:
+        return occludedOne<ShapeType::Sphere>(ray, i, tMax);
+    case ShapeType::Cylinder:
+        return occludedOne<ShapeType::Cylinder>(ray, i, tMax);
+    case ShapeType::Triangle:
+        return occludedOne<ShapeType::Triangle>(ray, i, tMax);
+    case ShapeType::Instance:
+        return static_cast<const Instance*>(instances[i])->occluded(ray, tMax);
+    }
+    return false;
+}
+
+template <ShapeType T>
+bool ShapePool::intersectType(const Ray& ray, const std::vector<Shape*>& shapes, Hit& hit) const {
+    bool found = false;
+    uint32_t count = static_cast<uint32_t>(shapes.size());
+    for (uint32_t i = 0; i < count; ++i) {
+        float distance;
+        if (intersectOne<T>(ray, i, distance) && distance < hit.distance) {
+            hit.distance = distance;
+            hit.shape = shapes[i];
+            hit.instance = nullptr;
+            found = true;
+        }
+    }
+    return found;
+}
+
+template <ShapeType T>
+bool ShapePool::occludedType(const Ray& ray, const std::vector<Shape*>& shapes, float tMax, Shape*& blocker) const {
+    uint32_t count = static_cast<uint32_t>(shapes.size());
+    for (uint32_t i = 0; i < count; ++i) {
+        if (occludedOne<T>(ray, i, tMax)) {
+            blocker = shapes[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+// Spheres and triangles are swept a block at a time. Lanes are visited in index order
+// and replace the hit only when strictly closer, so the result matches the
+// one-at-a-time sweep exactly.
+template <>
+bool ShapePool::intersectType<ShapeType::Sphere>(const Ray& ray, const std::vector<Shape*>& shapes, Hit& hit) const {
+    bool found = false;
+    float distances[kBlockSize];
+    for (size_t first = 0; first < shapes.size(); first += kBlockSize) {
+        int mask = intersectSphereBlock(ray, &spheres.centerX[first], &spheres.centerY[first], &spheres.centerZ[first],
+                                        &spheres.radiusSquared[first], distances);
+        found |= takeNearest(mask & laneMask(shapes.size() - first), distances, &shapes[first], hit);
+    }
+    return found;
+}
+
+template <>
+bool ShapePool::intersectType<ShapeType::Triangle>(const Ray& ray, const std::vector<Shape*>& shapes, Hit& hit) const {
+    bool found = false;
+    float distances[kBlockSize];
+    for (size_t first = 0; first < shapes.size(); first += kBlockSize) {
+        int mask = intersectTriangleBlock(ray, &triangles.v0x[first], &triangles.v0y[first], &triangles.v0z[first],
+                                          &triangles.edge1x[first], &triangles.edge1y[first], &triangles.edge1z[first],
+                                          &triangles.edge2x[first], &triangles.edge2y[first], &triangles.edge2z[first],
+                                          distances);
+        found |= takeNearest(mask & laneMask(shapes.size() - first), distances, &shapes[first], hit);
+    }
+    return found;
+}
+
+// Any hit: the first lane, in index order, closer than tMax
+template <>
+bool ShapePool::occludedType<ShapeType::Sphere>(const Ray& ray, const std::vector<Shape*>& shapes, float tMax,
+                                                Shape*& blocker) const {
+    float distances[kBlockSize];
+    for (size_t first = 0; first < shapes.size(); first += kBlockSize) {
+        int mask = intersectSphereBlock(ray, &spheres.centerX[first], &spheres.centerY[first], &spheres.centerZ[first],
+                                        &spheres.radiusSquared[first], distances);
+        if (takeFirst(mask & laneMask(shapes.size() - first), distances, tMax, &shapes[first], blocker)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <>
+bool ShapePool::occludedType<ShapeType::Triangle>(const Ray& ray, const std::vector<Shape*>& shapes, float tMax,
+                                                  Shape*& blocker) const {
+    float distances[kBlockSize];
+    for (size_t first = 0; first < shapes.size(); first += kBlockSize) {
+        int mask = intersectTriangleBlock(ray, &triangles.v0x[first], &triangles.v0y[first], &triangles.v0z[first],
+                                          &triangles.edge1x[first], &triangles.edge1y[first], &triangles.edge1z[first],
+                                          &triangles.edge2x[first], &triangles.edge2y[first], &triangles.edge2z[first],
+                                          distances);
+        if (takeFirst(mask & laneMask(shapes.size() - first), distances, tMax, &shapes[first], blocker)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ShapePool::intersectAll(const Ray& ray, Hit& hit) const {
+    bool found = intersectType<ShapeType::Sphere>(ray, spheres.shapes, hit);
+    found |= intersectType<ShapeType::Cylinder>(ray, cylinders.shapes, hit);
+    found |= intersectType<ShapeType::Triangle>(ray, triangles.shapes, hit);
+    for (Shape* instance : instances) {
+        found |= static_cast<const Instance*>(instance)->intersect(ray, hit);
+    }
+    return found;
+}
+
+bool ShapePool::occludedAll(const Ray& ray, float tMax, Shape*& blocker) const {
+    if (occludedType<ShapeType::Sphere>(ray, spheres.shapes, tMax, blocker) ||
+        occludedType<ShapeType::Cylinder>(ray, cylinders.shapes, tMax, blocker) ||
+        occludedType<ShapeType::Triangle>(ray, triangles.shapes, tMax, blocker)) {
+        return true;
+    }
+    for (Shape* instance : instances) {
+        if (static_cast<const Instance*>(instance)->occluded(ray, tMax)) {
+            blocker = instance;
+            return true;
+        }
+    }
+    return false;
+}
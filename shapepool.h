@@ -0,0 +1,81 @@
+#ifndef SHAPEPOOL_H
+#define SHAPEPOOL_H
+#include <cstdint>
+#include <vector>
+#include "base.h"
+
+// Compact reference to a pooled shape: its type in the top two bits, its index in that
+// type's pool below
+typedef uint32_t PrimitiveId;
+const int kPrimitiveTypeShift = 30;
+
+inline PrimitiveId makePrimitiveId(ShapeType type, uint32_t index) {
+    return (static_cast<uint32_t>(type) << kPrimitiveTypeShift) | index;
+}
+inline ShapeType primitiveType(PrimitiveId id) {
+    return static_cast<ShapeType>(id >> kPrimitiveTypeShift);
+}
+inline uint32_t primitiveIndex(PrimitiveId id) {
+    return id & ((1u << kPrimitiveTypeShift) - 1);
+}
+
+// The parameters of a set of shapes, copied into one structure-of-arrays pool per type.
+// A loop over one pool reads consecutive floats and runs one kernel, with no virtual
+// call or type test per shape. Every entry keeps a pointer back to its Shape, which hit
+// records and shading still use. Instances have no parameters worth pooling and are
+// only listed.
+class ShapePool {
+public:
+    // Pools hold the prepared data the kernels read, not the raw parameters. The sphere
+    // and triangle arrays are padded to whole kBlockSize blocks for the block kernels.
+    struct Spheres {
+        std::vector<float> centerX, centerY, centerZ, radiusSquared;
+        std::vector<Shape*> shapes;
+    };
+    struct Cylinders {
+        std::vector<float> centerX, centerY, centerZ;
+        std::vector<CylinderFrame> frames;
+        std::vector<Shape*> shapes;
+    };
+    struct Triangles {
+        std::vector<float> v0x, v0y, v0z, edge1x, edge1y, edge1z, edge2x, edge2y, edge2z;
+        std::vector<Shape*> shapes;
+    };
+
+    Spheres spheres;
+    Cylinders cylinders;
+    Triangles triangles;
+    std::vector<Shape*> instances;
+
+    void build(const std::vector<Shape*>& shapes);
+    void clear();
+    // Copies the data of every pooled shape again, after they moved and were prepared
+    void update();
+
+    // Id of each shape passed to build, in the same order
+    const std::vector<PrimitiveId>& ids() const { return primitiveIds; }
+    Shape* shape(PrimitiveId id) const;
+    size_t memoryUsage() const;
+
+    // Tests one pooled shape, updating hit as intersectPrimitive does
+    bool intersect(const Ray& ray, PrimitiveId id, Hit& hit) const;
+    bool occluded(const Ray& ray, PrimitiveId id, float tMax) const;
+    // Closest hit and any hit over every pooled shape, one type at a time
+    bool intersectAll(const Ray& ray, Hit& hit) const;
+    bool occludedAll(const Ray& ray, float tMax, Shape*& blocker) const;
+
+private:
+    std::vector<PrimitiveId> primitiveIds;
+
+    void store(PrimitiveId id, const Shape* shape);
+    template <ShapeType T>
+    bool intersectOne(const Ray& ray, uint32_t index, float& distance) const;
+    template <ShapeType T>
+    bool occludedOne(const Ray& ray, uint32_t index, float tMax) const;
+    template <ShapeType T>
+    bool intersectType(const Ray& ray, const std::vector<Shape*>& shapes, Hit& hit) const;
+    template <ShapeType T>
+    bool occludedType(const Ray& ray, const std::vector<Shape*>& shapes, float tMax, Shape*& blocker) const;
+};
+
+#endif // SHAPEPOOL_H
@@ -0,0 +1,38 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Compile-time SIMD capabilities. SSE2 is part of every x86-64 target; the AVX2 paths
+// guarded by RT_AVX2 need -mavx2 (GCC/Clang) or /arch:AVX2 (MSVC). Code guarded by
+// these macros always has a scalar or narrower fallback.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_SSE 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define RT_AVX2 1
+#include <immintrin.h>
+#endif
+
+// Runtime dispatch: where the compiler can build single functions for a newer
+// instruction set than the rest of the program, the AVX2 and AVX-512 kernels are built
+// into every binary, marked with RT_TARGET, and only called once cpu.h has found the
+// CPU supports them
+#if defined(RT_SSE) && (defined(__GNUC__) || defined(_MSC_VER))
+#define RT_DISPATCH 1
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define RT_TARGET(isa) __attribute__((target(isa)))
+#else
+#define RT_TARGET(isa)
+#endif
+#endif
+
+// Build switch: -DRT_SIMD_VECTORS stores Vector3 and Color in SSE registers (see base.h),
+// with results identical to the scalar build; adding -DRT_FAST_RSQRT trades exact
+// normalization for the reciprocal square root estimate.
+#if defined(RT_SIMD_VECTORS) && defined(RT_SSE)
+#define RT_SIMD_MATH 1
+#endif
+
+#endif // SIMD_H
@@ -0,0 +1,264 @@
+#include "widebvh.h"
+#include "intersect.h"
+#include "simd.h"
+
+namespace {
+// A wide tree is never deeper than its binary source, whose depth is capped at 60
+const int kStackSize = 8 * 64;
+
+struct StackEntry {
+    int index;  // Node index, or first primitive for leaves
+    int count;  // Leaf primitive count, 0 for interior nodes
+    float tNear;
+};
+}
+
+template <int Width>
+void WideBVH<Width>::build(const std::vector<Shape*>& shapes) {
+    binary.build(shapes);
+    collapse();
+}
+
+template <int Width>
+float WideBVH<Width>::refit() {
+    float cost = binary.refit();
+    collapse();
+    return cost;
+}
+
+template <int Width>
+bool WideBVH<Width>::saveCache(CacheWriter& out, const std::vector<Shape*>& shapes) const {
+    return binary.saveCache(out, shapes);
+}
+
+template <int Width>
+bool WideBVH<Width>::loadCache(CacheReader& in, const std::vector<Shape*>& shapes) {
+    bool loaded = binary.loadCache(in, shapes);
+    collapse();
+    return loaded;
+}
+
+template <int Width>
+size_t WideBVH<Width>::memoryUsage() const {
+    return nodes.size() * sizeof(Node) + binary.memoryUsage();
+}
+
+template <int Width>
+void WideBVH<Width>::collapse() {
+    nodes.clear();
+    if (binary.empty()) {
+        return;
+    }
+    nodes.reserve(binary.getNodes().size() / 2 + 1);
+    collapseNode(0);
+}
+
+template <int Width>
+int WideBVH<Width>::collapseNode(int binaryIndex) {
+    const std::vector<BVH::Node>& source = binary.getNodes();
+
+    // Greedily open the interior child with the largest surface area until the node is full
+    int slots[Width];
+    int slotCount = 1;
+    slots[0] = binaryIndex;
+    while (slotCount < Width) {
+        int largest = -1;
+        float largestArea = -1.0f;
+        for (int i = 0; i < slotCount; ++i) {
+            const BVH::Node& candidate = source[slots[i]];
+            if (!candidate.isLeaf() && candidate.bounds.surfaceArea() > largestArea) {
+                largestArea = candidate.bounds.surfaceArea();
+                largest = i;
+            }
+        }
+        if (largest < 0) {
+            break;
+        }
+        int opened = slots[largest];
+        slots[largest] = source[opened].leftFirst;
+        slots[slotCount++] = source[opened].leftFirst + 1;
+    }
+
+    int nodeIndex = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+    const float inf = std::numeric_limits<float>::infinity();
+    for (int i = 0; i < Width; ++i) {
+        Node& node = nodes[nodeIndex];
+        if (i >= slotCount) {
+            // Boxes at +infinity fail the slab test for every ray direction
+            node.minX[i] = node.minY[i] = node.minZ[i] = inf;
+            node.maxX[i] = node.maxY[i] = node.maxZ[i] = inf;
+            node.child[i] = 0;
+            node.count[i] = -1;
+            continue;
+        }
+        const BVH::Node& child = source[slots[i]];
+        node.minX[i] = child.bounds.min.x;
+        node.minY[i] = child.bounds.min.y;
+        node.minZ[i] = child.bounds.min.z;
+        node.maxX[i] = child.bounds.max.x;
+        node.maxY[i] = child.bounds.max.y;
+        node.maxZ[i] = child.bounds.max.z;
+        if (child.isLeaf()) {
+            node.child[i] = child.leftFirst;
+            node.count[i] = child.count;
+        } else {
+            // Recursion may grow the node array, so index it again afterwards
+            int childIndex = collapseNode(slots[i]);
+            nodes[nodeIndex].child[i] = childIndex;
+            nodes[nodeIndex].count[i] = 0;
+        }
+    }
+    return nodeIndex;
+}
+
+template <int Width>
+int WideBVH<Width>::intersectChildren(const Node& node, const Ray& ray, const Vector3& invDir, float tMax, float* tEnter) const {
+    int mask = 0;
+#if defined(RT_SSE)
+    // Both widths run on 4-lane SSE groups; with AVX2 the 8-wide node is one 8-lane group
+#if defined(RT_AVX2)
+    if (Width == 8) {
+        __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+        __m256 ix = _mm256_set1_ps(invDir.x), iy = _mm256_set1_ps(invDir.y), iz = _mm256_set1_ps(invDir.z);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.minX), ox), ix);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.maxX), ox), ix);
+        __m256 enter = _mm256_min_ps(t0, t1);
+        __m256 exit = _mm256_max_ps(t0, t1);
+        t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.minY), oy), iy);
+        t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.maxY), oy), iy);
+        enter = _mm256_max_ps(enter, _mm256_min_ps(t0, t1));
+        exit = _mm256_min_ps(exit, _mm256_max_ps(t0, t1));
+        t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.minZ), oz), iz);
+        t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.maxZ), oz), iz);
+        enter = _mm256_max_ps(enter, _mm256_min_ps(t0, t1));
+        exit = _mm256_min_ps(exit, _mm256_max_ps(t0, t1));
+        enter = _mm256_max_ps(enter, _mm256_setzero_ps());
+        exit = _mm256_min_ps(exit, _mm256_set1_ps(tMax));
+        _mm256_storeu_ps(tEnter, enter);
+        return _mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ));
+    }
+#endif
+    __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+    __m128 ix = _mm_set1_ps(invDir.x), iy = _mm_set1_ps(invDir.y), iz = _mm_set1_ps(invDir.z);
+    __m128 zero = _mm_setzero_ps();
+    __m128 limit = _mm_set1_ps(tMax);
+    for (int group = 0; group < Width; group += 4) {
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minX + group), ox), ix);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxX + group), ox), ix);
+        __m128 enter = _mm_min_ps(t0, t1);
+        __m128 exit = _mm_max_ps(t0, t1);
+        t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minY + group), oy), iy);
+        t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxY + group), oy), iy);
+        enter = _mm_max_ps(enter, _mm_min_ps(t0, t1));
+        exit = _mm_min_ps(exit, _mm_max_ps(t0, t1));
+        t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minZ + group), oz), iz);
+        t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxZ + group), oz), iz);
+        enter = _mm_max_ps(enter, _mm_min_ps(t0, t1));
+        exit = _mm_min_ps(exit, _mm_max_ps(t0, t1));
+        enter = _mm_max_ps(enter, zero);
+        exit = _mm_min_ps(exit, limit);
+        _mm_storeu_ps(tEnter + group, enter);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(enter, exit)) << group;
+    }
+#else
+    for (int i = 0; i < Width; ++i) {
+        AABB box(Vector3(node.minX[i], node.minY[i], node.minZ[i]), Vector3(node.maxX[i], node.maxY[i], node.maxZ[i]));
+        if (box.intersect(ray, invDir, tMax, tEnter[i])) {
+            mask |= 1 << i;
+        }
+    }
+#endif
+    return mask;
+}
+
+template <int Width>
+bool WideBVH<Width>::intersect(const Ray& ray, Hit& hit) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    Vector3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    const std::vector<Shape*>& primitives = binary.getPrimitives();
+
+    bool found = false;
+    StackEntry stack[kStackSize];
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0, 0.0f};
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        if (entry.tNear > hit.distance) {
+            continue;
+        }
+        if (entry.count > 0) {
+            for (int i = entry.index; i < entry.index + entry.count; ++i) {
+                if (intersectPrimitive(ray, primitives[i], hit)) {
+                    found = true;
+                }
+            }
+            continue;
+        }
+
+        const Node& node = nodes[entry.index];
+        alignas(32) float tEnter[Width];
+        int mask = intersectChildren(node, ray, invDir, hit.distance, tEnter);
+
+        // Order the children that were hit front to back; the stack is LIFO, so push the
+        // farthest first
+        int order[Width];
+        int hitCount = 0;
+        for (int i = 0; i < Width; ++i) {
+            if (mask & (1 << i)) {
+                int j = hitCount++;
+                while (j > 0 && tEnter[order[j - 1]] < tEnter[i]) {
+                    order[j] = order[j - 1];
+                    --j;
+                }
+                order[j] = i;
+            }
+        }
+        for (int k = 0; k < hitCount; ++k) {
+            int i = order[k];
+            stack[stackSize++] = {node.child[i], node.count[i], tEnter[i]};
+        }
+    }
+    return found;
+}
+
+template <int Width>
+bool WideBVH<Width>::occluded(const Ray& ray, float tMax, Shape*& blocker) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    Vector3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    const std::vector<Shape*>& primitives = binary.getPrimitives();
+
+    // No front-to-back sorting: leaf children are tested as soon as their box is hit,
+    // interior children are pushed in slot order, and the first blocker ends the query
+    int stack[kStackSize];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const Node& node = nodes[stack[--stackSize]];
+        alignas(32) float tEnter[Width];
+        int mask = intersectChildren(node, ray, invDir, tMax, tEnter);
+        for (int i = 0; i < Width; ++i) {
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+            if (node.count[i] > 0) {
+                for (int j = node.child[i]; j < node.child[i] + node.count[i]; ++j) {
+                    if (occludedPrimitive(ray, primitives[j], tMax)) {
+                        blocker = primitives[j];
+                        return true;
+                    }
+                }
+            } else if (node.count[i] == 0) {
+                stack[stackSize++] = node.child[i];
+            }
+        }
+    }
+    return false;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
@@ -0,0 +1,43 @@
+#ifndef WIDEBVH_H
+#define WIDEBVH_H
+#include <vector>
+#include "base.h"
+#include "accel.h"
+#include "bvh.h"
+
+// BVH with Width children per node (4 for SSE, 8 for AVX2), made by collapsing a binary
+// SAH tree. Child boxes are stored as structure-of-arrays so one node visit tests every
+// child against the ray with a single vector operation.
+template <int Width>
+class WideBVH : public Accelerator {
+public:
+    struct alignas(32) Node {
+        float minX[Width], minY[Width], minZ[Width];
+        float maxX[Width], maxY[Width], maxZ[Width];
+        int child[Width];  // Node index for interior children, first primitive for leaves
+        int count[Width];  // Primitives in a leaf child, 0 for interior, -1 for empty slots
+    };
+
+    void build(const std::vector<Shape*>& shapes) override;
+    // Refits the source binary tree and collapses it again
+    float refit() override;
+    bool intersect(const Ray& ray, Hit& hit) const override;
+    bool occluded(const Ray& ray, float tMax, Shape*& blocker) const override;
+    // Includes the binary source tree, which is kept for refits
+    size_t memoryUsage() const override;
+    const char* name() const override { return Width == 4 ? "bvh4" : "bvh8"; }
+    // Only the binary source tree is cached; collapsing it again is a linear pass
+    bool saveCache(CacheWriter& out, const std::vector<Shape*>& shapes) const override;
+    bool loadCache(CacheReader& in, const std::vector<Shape*>& shapes) override;
+
+private:
+    BVH binary;
+    std::vector<Node> nodes;
+
+    void collapse();
+    int collapseNode(int binaryIndex);
+    // Tests all child boxes of a node; returns a bit mask of hits and their entry distances
+    int intersectChildren(const Node& node, const Ray& ray, const Vector3& invDir, float tMax, float* tEnter) const;
+};
+
+#endif // WIDEBVH_H